@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+"""Generate the sensor calibration lookup tables from CSV curve descriptions.
+
+Each CSV file describes one curve as rows of "input_mv,value" where value is in
+milli-units of the engineering value (mdegC for a temperature sensor). Lines
+starting with '#' are comments. Between rows the curve is taken as linear, and
+beyond the first and last rows it is extended linearly.
+
+The curve is resampled on a uniform grid of 2^step_shift mV so that the
+firmware finds the segment of a sample with a shift instead of a search. Table
+entries are fixed point with --q fraction bits.
+"""
+
+import argparse
+import csv
+import os
+import re
+import sys
+
+
+def read_curve(path):
+    points = []
+    with open(path, newline="") as f:
+        rows = (line for line in f if line.strip() and not line.lstrip().startswith("#"))
+        for row in csv.reader(rows):
+            points.append((float(row[0]), float(row[1])))
+    points.sort()
+    if len(points) < 2:
+        sys.exit(f"{path}: a curve needs at least two points")
+    if any(a[0] == b[0] for a, b in zip(points, points[1:])):
+        sys.exit(f"{path}: duplicate input voltage")
+    return points
+
+
+def evaluate(points, mv):
+    # Segment holding mv, or the first/last one to extrapolate
+    for i in range(len(points) - 1):
+        if mv <= points[i + 1][0] or i == len(points) - 2:
+            (x0, y0), (x1, y1) = points[i], points[i + 1]
+            return y0 + (y1 - y0) * (mv - x0) / (x1 - x0)
+    raise AssertionError("unreachable")
+
+
+def curve_id(path):
+    return re.sub(r"[^A-Za-z0-9]", "_", os.path.splitext(os.path.basename(path))[0])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("-o", "--output", required=True, help="header to write")
+    parser.add_argument("--step-shift", type=int, default=5, help="log2 of the grid step in mV")
+    parser.add_argument("--segments", type=int, default=128, help="number of grid segments")
+    parser.add_argument("--q", type=int, default=8, help="fraction bits of the table entries")
+    parser.add_argument("curves", nargs="+", help="CSV curve descriptions, the first is curve 0")
+    args = parser.parse_args()
+
+    lines = [
+        "/* Generated by scripts/gen_calibration_lut.py from "
+        + ", ".join(os.path.basename(c) for c in args.curves) + ", do not edit. */",
+        "",
+        "#ifndef CALIBRATION_LUT_H_",
+        "#define CALIBRATION_LUT_H_",
+        "",
+        f"#define CAL_LUT_STEP_SHIFT     {args.step_shift}",
+        f"#define CAL_LUT_SEGMENTS       {args.segments}",
+        f"#define CAL_LUT_Q              {args.q}",
+        "",
+        "#define SENSOR_CURVE_TABLE(X) \\",
+    ]
+    lines += [f'    X({curve_id(c).upper()}, "{curve_id(c)}") \\' for c in args.curves]
+    lines += [
+        "",
+        "",
+        "static const int32_t sensor_curve_lut[][CAL_LUT_SEGMENTS + 1] = {",
+    ]
+    limit = 2 ** 31 - 1
+    for path in args.curves:
+        points = read_curve(path)
+        values = []
+        for k in range(args.segments + 1):
+            value = round(evaluate(points, k << args.step_shift) * (1 << args.q))
+            if abs(value) > limit:
+                sys.exit(f"{path}: value at {k << args.step_shift} mV does not fit the table")
+            values.append(value)
+        lines.append(f"    {{  /* {curve_id(path)} */")
+        for i in range(0, len(values), 8):
+            lines.append("        " + " ".join(f"{v}," for v in values[i:i + 8]))
+        lines.append("    },")
+    lines += ["};", "", "#endif /* CALIBRATION_LUT_H_ */", ""]
+
+    os.makedirs(os.path.dirname(os.path.abspath(args.output)), exist_ok=True)
+    with open(args.output, "w") as f:
+        f.write("\n".join(lines))
+
+
+if __name__ == "__main__":
+    main()
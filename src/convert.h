@@ -0,0 +1,308 @@
+/**
+ * @file convert.h
+ * @brief Conversion of raw ADC counts to calibrated milli-units, and the q31 block kernels of
+ *        the processing stage.
+ *
+ * Shared by the application and the conversion benchmark, so both time and check the same
+ * code. ADC_BLOCK_MAX sizes the FIR delay line and defaults to the application value; the
+ * calibration curves come from the generated calibration_lut.h. Everything is static: the
+ * header is included by a single translation unit of each image.
+ */
+
+#ifndef CONVERT_H_
+#define CONVERT_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+#include "calibration_lut.h"
+#if IS_ENABLED(CONFIG_CMSIS_DSP)
+#include <arm_math.h>
+#endif
+
+#ifndef ADC_BLOCK_MAX
+#define ADC_BLOCK_MAX          256     // Largest acquisition block, in samples
+#endif
+#ifndef PROCESSING_FIXED_POINT
+#define PROCESSING_FIXED_POINT 1       // Set to 0 to look up the curves in float, the reference path
+#endif
+
+#define ADC_FULL_SCALE(bits)   ((int)BIT(bits) - 1)
+#define SENSOR_FULL_SCALE_MV   3000    // Input voltage at ADC_FULL_SCALE()
+// Float reference of the linear curve: temperature [mdegC] = SENSOR_MDEGC_PER_MV * (input [mV] - SENSOR_OFFSET_MV)
+#define SENSOR_OFFSET_MV       1000    // Input voltage at 0 degC
+#define SENSOR_MDEGC_PER_MV    60
+
+#define PROCESSING_CMSIS_DSP   IS_ENABLED(CONFIG_CMSIS_DSP)  // Block kernels from CMSIS-DSP, else portable C
+#define CONVERT_TOLERANCE      2       // Largest difference between the linear curve and its float reference, in mdegC
+#define CAL_GAIN_ONE           BIT(30) // Two-point calibration gain of 1.0, as a q31 scale factor
+#define CAL_GAIN_SHIFT         (1 - CAL_LUT_Q)  // q31 scale shift that also drops the table fraction bits
+
+/**
+ * @brief Calibration curves, generated from the CSV files listed in CMakeLists.txt.
+ */
+typedef enum {
+#define SENSOR_CURVE_ID(id, name) SENSOR_CURVE_##id,
+    SENSOR_CURVE_TABLE(SENSOR_CURVE_ID)
+#undef SENSOR_CURVE_ID
+    SENSOR_CURVE_COUNT
+} SensorCurveId;
+
+BUILD_ASSERT(ARRAY_SIZE(sensor_curve_lut) == SENSOR_CURVE_COUNT, "Calibration table out of date");
+
+/**
+ * @struct SensorConversion
+ * @brief Transfer function of an analog channel: ADC code to input voltage, then calibration curve.
+ */
+typedef struct {
+    int32_t full_scale_mv;  ///< Input voltage at the ADC full scale.
+    uint8_t curve;  ///< SensorCurveId of the calibration curve.
+} SensorConversion;
+
+#if !IS_ENABLED(CONFIG_CMSIS_DSP)
+typedef int16_t q15_t;
+typedef int32_t q31_t;
+typedef int64_t q63_t;
+#endif
+
+#define DSP_FIR_TAPS           8
+
+/**
+ * @brief Low-pass FIR coefficients in q31: Hamming-windowed sinc, cutoff 0.1 fs, unity DC gain.
+ *
+ * The filter is symmetric, so the time-reversed order CMSIS-DSP expects is the same.
+ */
+static const q31_t dsp_fir_coeffs[DSP_FIR_TAPS] = {
+    18800667, 102969419, 352239698, 599732040, 599732040, 352239698, 102969419, 18800667,
+};
+
+/**
+ * @struct DspFir
+ * @brief State of a q31 FIR filter, kept across blocks so the output has no seams.
+ */
+typedef struct {
+#if PROCESSING_CMSIS_DSP
+    arm_fir_instance_q31 instance;
+#endif
+    q31_t state[DSP_FIR_TAPS + ADC_BLOCK_MAX - 1];  ///< Delay line, newest samples last.
+} DspFir;
+
+/*
+ * Block kernels of the processing stage. Each one calls the CMSIS-DSP function of the same
+ * name when PROCESSING_CMSIS_DSP is set, and otherwise a portable C loop with the same
+ * arithmetic, saturation and truncation, so both builds produce identical samples.
+ */
+
+/**
+ * @brief Saturating 32-bit left shift, as the q31 kernels do it.
+ */
+static inline q31_t dsp_sat_shl_q31(q63_t value, int shift) {
+    value = shift > 0 ? value << shift : value >> -shift;
+    return (q31_t)CLAMP(value, INT32_MIN, INT32_MAX);
+}
+
+/**
+ * @brief Multiplies q31 samples by scale_fract * 2^shift, with saturation.
+ */
+static inline void dsp_scale_q31(const q31_t *src, q31_t scale_fract, int8_t shift, q31_t *dst, uint32_t count) {
+#if PROCESSING_CMSIS_DSP
+    arm_scale_q31(src, scale_fract, shift, dst, count);
+#else
+    for (uint32_t i = 0; i < count; i++) {
+        dst[i] = dsp_sat_shl_q31(((q63_t)src[i] * scale_fract) >> 32, shift + 1);
+    }
+#endif
+}
+
+/**
+ * @brief Adds a constant to q31 samples, with saturation.
+ */
+static inline void dsp_offset_q31(const q31_t *src, q31_t offset, q31_t *dst, uint32_t count) {
+#if PROCESSING_CMSIS_DSP
+    arm_offset_q31(src, offset, dst, count);
+#else
+    for (uint32_t i = 0; i < count; i++) {
+        dst[i] = dsp_sat_shl_q31((q63_t)src[i] + offset, 0);
+    }
+#endif
+}
+
+/**
+ * @brief Resets a FIR filter to zero history with the dsp_fir_coeffs taps.
+ */
+static inline void dsp_fir_init(DspFir *fir) {
+#if PROCESSING_CMSIS_DSP
+    arm_fir_init_q31(&fir->instance, DSP_FIR_TAPS, dsp_fir_coeffs, fir->state, ADC_BLOCK_MAX);
+#else
+    memset(fir->state, 0, sizeof(fir->state));
+#endif
+}
+
+/**
+ * @brief Filters a block of q31 samples, continuing from the previous block.
+ */
+static inline void dsp_fir_q31(DspFir *fir, const q31_t *src, q31_t *dst, uint32_t count) {
+#if PROCESSING_CMSIS_DSP
+    arm_fir_q31(&fir->instance, src, dst, count);
+#else
+    q31_t *line = fir->state;
+
+    memcpy(&line[DSP_FIR_TAPS - 1], src, count * sizeof(q31_t));
+    for (uint32_t i = 0; i < count; i++) {
+        q63_t acc = 0;
+        for (int tap = 0; tap < DSP_FIR_TAPS; tap++) {
+            acc += (q63_t)dsp_fir_coeffs[tap] * line[i + tap];
+        }
+        dst[i] = (q31_t)(acc >> 31);
+    }
+    memmove(line, &line[count], (DSP_FIR_TAPS - 1) * sizeof(q31_t));
+#endif
+}
+
+/**
+ * @brief Returns the mean of a block of q31 samples, truncated toward zero.
+ */
+static inline q31_t dsp_mean_q31(const q31_t *src, uint32_t count) {
+    q31_t mean;
+#if PROCESSING_CMSIS_DSP
+    arm_mean_q31(src, count, &mean);
+#else
+    q63_t sum = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        sum += src[i];
+    }
+    mean = (q31_t)(sum / (q63_t)count);
+#endif
+    return mean;
+}
+
+/**
+ * @brief Converts a raw ADC count with the float formula of the linear sensor, as a reference.
+ *
+ * @param raw Raw ADC count.
+ * @param resolution ADC resolution in bits.
+ * @param full_scale_mv Input voltage at the ADC full scale.
+ * @return int32_t Temperature in mdegC.
+ */
+static inline int32_t convert_raw_float(int16_t raw, uint8_t resolution, int32_t full_scale_mv) {
+    float voltage = (raw / (float)ADC_FULL_SCALE(resolution)) * (full_scale_mv / 1000.0f);  // Convert ADC value to voltage
+    //return 60 * (voltage - 1);        // Convert voltage to temperature
+    return (int32_t)(SENSOR_MDEGC_PER_MV * 1000 * (voltage - SENSOR_OFFSET_MV / 1000.0f));
+}
+
+/**
+ * @struct SensorCalibration
+ * @brief Per-unit two-point calibration of a channel, applied on top of its curve.
+ *
+ * value = curve value * gain_fract / 2^30 + offset, computed with the q31 scale and offset
+ * kernels. Identity is { CAL_GAIN_ONE, 0 }.
+ */
+typedef struct {
+    int32_t gain_fract;  ///< Gain as a q31 scale factor, CAL_GAIN_ONE is 1.0.
+    int32_t offset;  ///< Offset in milli-units.
+} SensorCalibration;
+
+/**
+ * @brief Converts a block of raw ADC counts of one channel to uncalibrated curve values, in fixed point.
+ *
+ * The code is scaled to mV in Q16 with one 32x64 multiply, whose top bits index the uniform grid of the curve table
+ * and whose low bits interpolate linearly inside the segment. Codes outside the table extend
+ * the first or last segment. Integer multiplies and shifts only, no division per sample.
+ *
+ * @param raw Raw ADC counts.
+ * @param resolution ADC resolution in bits the counts were taken with.
+ * @param conv Transfer function of the channel.
+ * @param value Output values in milli-units with CAL_LUT_Q fraction bits.
+ * @param count Number of samples.
+ */
+static inline void calibration_lut_block_fixed(const int16_t *raw, uint8_t resolution,
+                                               const SensorConversion *conv, int32_t *value, uint32_t count) {
+    const int32_t *lut = sensor_curve_lut[conv->curve];
+    // Q32 step so that the rounding of the step stays below one code even at 14 bits
+    int64_t mv_per_code_q32 = ((int64_t)conv->full_scale_mv << 32) / ADC_FULL_SCALE(resolution);
+
+    for (uint32_t i = 0; i < count; i++) {
+        int32_t mv_q16 = (raw[i] * mv_per_code_q32) >> 16;
+        int segment = CLAMP(mv_q16 >> (16 + CAL_LUT_STEP_SHIFT), 0, CAL_LUT_SEGMENTS - 1);
+        int32_t offset_q16 = mv_q16 - (segment << (16 + CAL_LUT_STEP_SHIFT));
+        int32_t slope = lut[segment + 1] - lut[segment];
+        value[i] = lut[segment] + (int32_t)(((int64_t)slope * offset_q16) >> (16 + CAL_LUT_STEP_SHIFT));
+    }
+}
+
+/**
+ * @brief Converts a block like calibration_lut_block_fixed(), with the voltage and the
+ *        interpolation computed in float.
+ *
+ * Reference path selected with PROCESSING_FIXED_POINT 0. On the soft-float ABI every operation
+ * is emulated, which is what the fixed point path avoids.
+ */
+static inline void calibration_lut_block_float(const int16_t *raw, uint8_t resolution,
+                                               const SensorConversion *conv, int32_t *value, uint32_t count) {
+    const int32_t *lut = sensor_curve_lut[conv->curve];
+    float mv_per_code = conv->full_scale_mv / (float)ADC_FULL_SCALE(resolution);
+    float step_mv = BIT(CAL_LUT_STEP_SHIFT);
+
+    for (uint32_t i = 0; i < count; i++) {
+        float mv = raw[i] * mv_per_code;
+        int segment = CLAMP((int)floorf(mv / step_mv), 0, CAL_LUT_SEGMENTS - 1);
+        float slope = (lut[segment + 1] - lut[segment]) / step_mv;
+        value[i] = lut[segment] + (int32_t)(slope * (mv - segment * step_mv));
+    }
+}
+
+/**
+ * @brief Converts a block of raw ADC counts of one channel to uncalibrated curve values, on the
+ *        path selected by PROCESSING_FIXED_POINT.
+ */
+static inline void calibration_lut_block(const int16_t *raw, uint8_t resolution, const SensorConversion *conv,
+                                         int32_t *value, uint32_t count) {
+#if PROCESSING_FIXED_POINT
+    calibration_lut_block_fixed(raw, resolution, conv, value, count);
+#else
+    calibration_lut_block_float(raw, resolution, conv, value, count);
+#endif
+}
+
+/**
+ * @brief Applies the two-point calibration of a channel and drops the table fraction bits.
+ *
+ * @param cal Calibration of the channel.
+ * @param value Values from calibration_lut_block(), replaced by calibrated milli-units.
+ * @param count Number of samples.
+ */
+static inline void calibration_apply_block(const SensorCalibration *cal, int32_t *value, uint32_t count) {
+    dsp_scale_q31(value, cal->gain_fract, CAL_GAIN_SHIFT, value, count);
+    dsp_offset_q31(value, cal->offset, value, count);
+}
+
+/**
+ * @brief Converts a block of raw ADC counts of one channel to calibrated milli-units.
+ *
+ * @param raw Raw ADC counts.
+ * @param resolution ADC resolution in bits the counts were taken with.
+ * @param conv Transfer function of the channel.
+ * @param cal Two-point calibration of the channel.
+ * @param value Output values in milli-units.
+ * @param count Number of samples.
+ * @return int32_t Mean of the block before the two-point calibration, with CAL_LUT_Q fraction bits.
+ */
+static inline int32_t convert_block(const int16_t *raw, uint8_t resolution, const SensorConversion *conv,
+                             const SensorCalibration *cal, int32_t *value, uint32_t count) {
+    calibration_lut_block(raw, resolution, conv, value, count);
+    int32_t mean = dsp_mean_q31(value, count);
+    calibration_apply_block(cal, value, count);
+    return mean;
+}
+
+/**
+ * @brief Applies the two-point calibration to one uncalibrated value, as calibration_apply_block() does.
+ */
+static inline int32_t calibration_apply(const SensorCalibration *cal, int32_t value) {
+    int32_t scaled = ((int64_t)value * cal->gain_fract) >> 32;
+    return (scaled >> -(CAL_GAIN_SHIFT + 1)) + cal->offset;
+}
+
+#endif /* CONVERT_H_ */
@@ -5,51 +5,250 @@
 #include <zephyr/sys/printk.h>
 #include <zephyr/drivers/uart.h>
 #include <zephyr/drivers/adc.h>     
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/barrier.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/timing/timing.h>
+#include <stdlib.h>
+#include "seqlock.h"
+#include "rtdb.h"
 
 
 #define SLEEP_TIME_MS          1000
 #define RECEIVE_BUFF_SIZE      10
 #define RECEIVE_TIMEOUT        100
+#define UART_REQUEST_DEPTH     4       // Commands waiting for uart_command_thread
+#define UART_ARG_COMMANDS      "pdkrfmxyzwvsgujo"        // Commands taking a decimal argument
+#define UART_COMMANDS          "1234567890lhtbnieqaCR"   // Commands without argument
 
 #include <hal/nrf_saadc.h>
 #define ADC_RESOLUTION 10
+#define ADC_OVERSAMPLING 0      // log2 of the conversions averaged by the SAADC for each sample
+#define ADC_OVERSAMPLING_MAX 8
+#define ADC_RESOLUTION_MIN 8    // Resolutions selectable at run time, in steps of 2 bits
+#define ADC_RESOLUTION_MAX 14
 #define ADC_GAIN ADC_GAIN_1_4
 #define ADC_REFERENCE ADC_REF_VDD_1_4
 #define ADC_ACQUISITION_TIME ADC_ACQ_TIME(ADC_ACQ_TIME_MICROSECONDS, 40)
+#define ADC_ACQ_TIME_DEFAULT_US 10      // SAADC acquisition time of channels left at ADC_ACQ_TIME_DEFAULT
+#define ADC_CONVERSION_US      2       // SAADC conversion time following the acquisition (tCONV)
 #define ADC_CHANNEL_ID 1
 #define ADC_CHANNEL_INPUT NRF_SAADC_INPUT_AIN1
 
+// Analog channels are the io-channels of the zephyr,user node, all scanned by one sequence.
+// Without that property the single channel configured above is sampled.
+#define ZEPHYR_USER_NODE       DT_PATH(zephyr_user)
+#if DT_NODE_HAS_PROP(ZEPHYR_USER_NODE, io_channels)
+#define SENSOR_CHANNEL_COUNT   DT_PROP_LEN(ZEPHYR_USER_NODE, io_channels)
+#else
+#define SENSOR_CHANNEL_COUNT   1
+#endif
+#define SENSOR_CHANNEL_MAX     8       // Channels with points in RTDB_POINT_TABLE, one per SAADC input
+
+#define ADC_RATE_MIN_HZ        1       // Slowest continuous acquisition rate
+#define ADC_RATE_MAX_HZ        20000   // Fastest continuous acquisition rate
+#define ADC_RATE_DEFAULT_HZ    1       // Acquisition rate at boot
+
+// Adaptive sampling: the rate is raised towards the ceiling while the signal of channel 0 moves
+// and brought back to the base rate set with 'r' once it has been steady for a while.
+#define ADAPTIVE_MAX_HZ        0       // Rate ceiling at boot, 0 leaves adaptive sampling off until 'g'
+#define ADAPTIVE_SLOPE         1000    // Rate of change that speeds sampling up, in mdegC/s
+#define ADAPTIVE_STDDEV        500     // Standard deviation in a block that speeds sampling up, in mdegC
+#define ADAPTIVE_STEP          4       // Rate factor of one step up or down
+#define ADAPTIVE_HOLD_MS       2000    // Steady time before stepping down
+#define ADC_BLOCK_MAX          256     // Largest acquisition block, in samples
+#define ADC_BLOCK_PERIOD_MS    100     // Blocks are sized to hold about this much signal
+#define ADC_CAL_PERIOD_MS      60000   // Offset recalibration period, run between two blocks
+#define ADC_CAL_RESOLUTION     12      // Resolution of the offset measurement
+#define ADC_CAL_OVERSAMPLING   4       // log2 of the conversions averaged by the offset measurement
+#define SAMPLE_BUFFER_COUNT    6       // Sample buffers shared by all pipeline stages
+#define QUEUE_ADC_RAW_DEPTH    2       // Blocks waiting for the processing stage
+#define QUEUE_SENSOR_DATA_DEPTH 1      // Blocks waiting for the database stage
+#ifndef PIPELINE_FUSED
+#define PIPELINE_FUSED         0       // 1 runs processing and database in one work item per block (CMake -DPIPELINE_FUSED=ON)
+#endif
+
+// Report by exception: a channel is written to the RTDB only when it leaves the deadband around
+// its last reported value, or when it has been silent for the heartbeat period. Defaults can be
+// overridden per channel with the sensor-deadband, sensor-deadband-permille and
+// sensor-heartbeat-ms arrays of the zephyr,user node.
+#define DEADBAND_DEFAULT       0       // Absolute deadband, in milli-units (0 suppresses only repeats)
+#define DEADBAND_DEFAULT_PERMILLE 0    // Relative deadband, in 0.1 % of the last reported value
+#define HEARTBEAT_DEFAULT_MS   10000   // Longest time without a report, 0 disables the heartbeat
+
+#include "pipeline.h"  // Sized by SENSOR_CHANNEL_COUNT, ADC_BLOCK_MAX and SAMPLE_BUFFER_COUNT above
+// Samples are converted to engineering values by the calibration curves generated from
+// calibration/*.csv (see convert.h). A channel picks its curve and full scale with the
+// sensor-curve and sensor-full-scale-mv arrays of the zephyr,user node, indexed like io-channels.
+#include "convert.h"
+
 // Global ADC device instance
 const struct device *adc_dev = DEVICE_DT_GET_ONE(nordic_nrf_saadc);
 
+BUILD_ASSERT(RTDB_POINT_CH_VAL(SENSOR_CHANNEL_MAX - 1) == RTDB_POINT_AN7_VAL, "Analog points out of order");
+BUILD_ASSERT(SENSOR_CHANNEL_COUNT <= SENSOR_CHANNEL_MAX, "More io-channels than analog points");
+
+#define STATS_FRAC_BITS        8        // Fractional bits of the fixed-point EWMA and of the m2 terms
+#define STATS_MEAN_FRAC_BITS   32       // Fractional bits of the mean, so its increment never rounds to 0
+#define STATS_EWMA_SHIFT       3        // EWMA smoothing factor alpha = 1 / 2^STATS_EWMA_SHIFT
+#define STATS_HIST_MIN         -60000   // Lower edge of the histogram (processed units)
+#define STATS_HIST_BUCKET      5000     // Width of one histogram bucket (processed units)
+#define STATS_HIST_BUCKETS     36       // Buckets span -60000 .. 120000, the full sensor range
+
 /**
- * @struct IoModuleData
- * @brief Holds all input/output module data including state of LEDs, buttons and ADC values.
+ * @struct SensorStats
+ * @brief Running statistics of the processed analog value, updated in O(1) per sample.
+ *
+ * Mean and variance use Welford's algorithm in integer arithmetic: @c mean holds the running
+ * mean with STATS_MEAN_FRAC_BITS fractional bits, enough for a one-unit deviation to still move
+ * it after 2^32 samples, and @c m2 the sum of squared deviations. Values
+ * outside the histogram range are counted in the first or last bucket.
  */
 typedef struct {
-    uint8_t led_state[4];  // States of 4 LEDs
-    uint8_t button_state[4];  // States of 4 buttons
-    int16_t an_raw;  // Raw analog sensor value
-    int an_val;  // Processed analog sensor value as integer (e.g., milli-degrees Celsius)
-} IoModuleData;
+    uint32_t count;  ///< Number of samples aggregated.
+    int min;  ///< Smallest value seen.
+    int max;  ///< Largest value seen.
+    int64_t mean;  ///< Running mean, fixed point.
+    int64_t m2;  ///< Sum of squared deviations from the mean.
+    int64_t ewma;  ///< Exponentially weighted moving average, fixed point.
+    uint32_t hist[STATS_HIST_BUCKETS];  ///< Histogram used for approximate percentiles.
+} SensorStats;
+
+static SensorStats sensor_stats;
+static atomic_t sensor_stats_seq;  ///< Sequence counter, odd while sensor_stats is updated.
+static struct k_spinlock sensor_stats_lock;  ///< Keeps readers, even in interrupt context, out of an update.
 
 /**
- * @struct RealTimeDatabase
- * @brief Struct to hold real-time data and a mutex for thread-safe access.
+ * @brief Adds a sample to the running statistics.
+ *
+ * As in rtdb_write_begin(), the update runs under a spinlock so a reader in the UART
+ * interrupt can never preempt it and spin on an odd sequence.
+ *
+ * @param value Processed analog sensor value.
  */
-typedef struct {
-    IoModuleData data;  ///< Embedded structure to hold module data.
-    struct k_mutex lock;  ///< Mutex to protect access to data.
-} RealTimeDatabase;
+static void sensor_stats_update(int value) {
+    int64_t x = (int64_t)value << STATS_FRAC_BITS;
+    int64_t x_mean = (int64_t)value << STATS_MEAN_FRAC_BITS;
+    int bucket = CLAMP((value - STATS_HIST_MIN) / STATS_HIST_BUCKET, 0, STATS_HIST_BUCKETS - 1);
+
+    k_spinlock_key_t key = k_spin_lock(&sensor_stats_lock);
+    seqlock_write_begin(&sensor_stats_seq);
+
+    if (sensor_stats.count == 0) {
+        sensor_stats.min = value;
+        sensor_stats.max = value;
+        sensor_stats.ewma = x;
+    }
+    sensor_stats.count++;
+    sensor_stats.min = MIN(sensor_stats.min, value);
+    sensor_stats.max = MAX(sensor_stats.max, value);
+
+    // Deviations are brought down to STATS_FRAC_BITS for the product, which would overflow otherwise
+    int64_t delta = x_mean - sensor_stats.mean;
+    sensor_stats.mean += delta / sensor_stats.count;
+    sensor_stats.m2 += ((delta >> (STATS_MEAN_FRAC_BITS - STATS_FRAC_BITS)) *
+                        ((x_mean - sensor_stats.mean) >> (STATS_MEAN_FRAC_BITS - STATS_FRAC_BITS))) >>
+                       (2 * STATS_FRAC_BITS);
+
+    sensor_stats.ewma += (x - sensor_stats.ewma) >> STATS_EWMA_SHIFT;
+    sensor_stats.hist[bucket]++;
+
+    seqlock_write_end(&sensor_stats_seq);
+    k_spin_unlock(&sensor_stats_lock, key);
+}
+
+/**
+ * @brief Copies out a consistent view of the running statistics without blocking the writer.
+ *
+ * @param out Destination for the copy.
+ */
+static void sensor_stats_snapshot(SensorStats *out) {
+    atomic_val_t seq;
 
-static RealTimeDatabase rtdb;
+    do {
+        seq = seqlock_read_begin(&sensor_stats_seq);
+        memcpy(out, &sensor_stats, sizeof(*out));
+    } while (seqlock_read_retry(&sensor_stats_seq, seq));
+}
 
-typedef struct {
-    int16_t raw_value;
-    float temperature;
-} SensorData;
+/**
+ * @brief Computes the integer square root of a non-negative value.
+ *
+ * @param x Value to take the root of.
+ * @return uint32_t Largest integer whose square does not exceed @p x.
+ */
+static uint32_t isqrt64(uint64_t x) {
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while (bit > x) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)root;
+}
 
+/**
+ * @brief Returns the sample standard deviation held in a statistics snapshot.
+ *
+ * @param stats Snapshot taken with sensor_stats_snapshot().
+ * @return int Standard deviation in processed units, 0 with fewer than two samples.
+ */
+static int sensor_stats_stddev(const SensorStats *stats) {
+    if (stats->count < 2) {
+        return 0;
+    }
+    return isqrt64(stats->m2 / (stats->count - 1));
+}
 
+/**
+ * @brief Estimates a percentile from the histogram of a statistics snapshot.
+ *
+ * The result is interpolated linearly inside the bucket holding the requested rank and
+ * clamped to the observed minimum and maximum.
+ *
+ * @param stats Snapshot taken with sensor_stats_snapshot().
+ * @param pct Percentile to estimate, 0 to 100.
+ * @return int Approximate value at the given percentile.
+ */
+static int sensor_stats_percentile(const SensorStats *stats, int pct) {
+    uint32_t rank = ((uint64_t)stats->count * pct + 99) / 100;
+    uint32_t seen = 0;
+
+    if (stats->count == 0) {
+        return 0;
+    }
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        if (stats->hist[i] != 0 && seen + stats->hist[i] >= rank) {
+            int low = STATS_HIST_MIN + i * STATS_HIST_BUCKET;
+            int value = low + (int)(((uint64_t)(rank - seen) * STATS_HIST_BUCKET) / stats->hist[i]);
+            return CLAMP(value, stats->min, stats->max);
+        }
+        seen += stats->hist[i];
+    }
+    return stats->max;
+}
+
+
+#if DT_NODE_HAS_PROP(ZEPHYR_USER_NODE, io_channels)
+#define SENSOR_ADC_SPEC(node, prop, idx) ADC_DT_SPEC_GET_BY_IDX(node, idx),
+
+static const struct adc_dt_spec adc_channels[SENSOR_CHANNEL_COUNT] = {
+    DT_FOREACH_PROP_ELEM(ZEPHYR_USER_NODE, io_channels, SENSOR_ADC_SPEC)
+};
+#else
 static const struct adc_channel_cfg my_channel_cfg = {
     .gain = ADC_GAIN,
     .reference = ADC_REFERENCE,
@@ -57,6 +256,20 @@ static const struct adc_channel_cfg my_channel_cfg = {
     .channel_id = ADC_CHANNEL_ID,
     .input_positive = ADC_CHANNEL_INPUT
 };
+#endif
+
+#define SENSOR_DT_PARAM(idx, prop, default_value)                                       \
+    COND_CODE_1(DT_PROP_HAS_IDX(ZEPHYR_USER_NODE, prop, idx),                          \
+                (DT_PROP_BY_IDX(ZEPHYR_USER_NODE, prop, idx)), (default_value))
+#define SENSOR_CONVERSION(idx, _)                                                       \
+    {                                                                                   \
+        .full_scale_mv = SENSOR_DT_PARAM(idx, sensor_full_scale_mv, SENSOR_FULL_SCALE_MV), \
+        .curve = SENSOR_DT_PARAM(idx, sensor_curve, SENSOR_CURVE_LINEAR),                \
+    }
+
+static const SensorConversion sensor_conversions[SENSOR_CHANNEL_COUNT] = {
+    LISTIFY(SENSOR_CHANNEL_COUNT, SENSOR_CONVERSION, (,), _)
+};
 
 // GPIO device tree specs for LEDs and buttons
 static const struct gpio_dt_spec led0 = GPIO_DT_SPEC_GET(DT_ALIAS(led0), gpios);
@@ -74,38 +287,734 @@ void led_thread(void *p1, void *p2, void *p3);
 
 
 
-K_THREAD_DEFINE(button_tid, 512, button_thread, NULL, NULL, NULL, 7, 0, 0);
+K_THREAD_DEFINE(button_tid, 1024, button_thread, NULL, NULL, NULL, 7, 0, 0);
 K_THREAD_DEFINE(led_tid, 1024, led_thread, NULL, NULL, NULL, 7, 0, 0);
 
 void uart_callback(const struct device *dev, struct uart_event *evt, void *user_data);
+void uart_command_thread(void *p1, void *p2, void *p3);
 
-K_THREAD_STACK_DEFINE(uart_stack, 1024);
+K_THREAD_STACK_DEFINE(uart_stack, 2048);  // Formats the replies, 'd' keeps a copy of the points on it
 struct k_thread uart_thread_data;
 
-K_THREAD_STACK_DEFINE(adc_stack, 1024);  // Define stack for ADC thread
-struct k_thread adc_thread_data;         // Define thread data for ADC thread
+/**
+ * @struct UartRequest
+ * @brief A command received on the UART, queued for uart_command_thread.
+ */
+typedef struct {
+    uint8_t cmd;  ///< Command letter.
+    bool negative;  ///< The argument had a leading '-'.
+    uint32_t arg;  ///< Magnitude of the decimal argument, 0 if none.
+    uint32_t arg_scale;  ///< Weight of the first digit of the argument, 0 if none.
+} UartRequest;
+
+K_MSGQ_DEFINE(uart_requests, sizeof(UartRequest), UART_REQUEST_DEPTH, 4);
+static atomic_t uart_requests_dropped;  // Commands received while uart_requests was full, reported with the next reply
+K_SEM_DEFINE(uart_tx_idle, 1, 1);  // Taken for each transmission, given back on UART_TX_DONE or UART_TX_ABORTED
+
+// Continuous acquisition control, see adc_start_continuous()
+static atomic_t adc_rate_hz = ATOMIC_INIT(ADC_RATE_DEFAULT_HZ);
+static atomic_t adc_base_rate_hz = ATOMIC_INIT(ADC_RATE_DEFAULT_HZ);  // Rate set with 'r', the adaptive floor
+static atomic_t adc_resolution = ATOMIC_INIT(ADC_RESOLUTION);
+static atomic_t adc_oversampling = ATOMIC_INIT(ADC_OVERSAMPLING);
+static atomic_t adc_restart;  // Set to stop acquisition at the next block boundary
+static atomic_t adc_overruns;  // Blocks dropped because no sample buffer was free
+K_SEM_DEFINE(adc_stopped, 0, 1); // Given when the acquisition stopped at a block boundary
+static struct k_poll_signal adc_done = K_POLL_SIGNAL_INITIALIZER(adc_done);  // Raised by the driver when the sequence ends
+static uint32_t adc_scan_us;  // Conversion time of one scan of all channels, without oversampling
+static atomic_t adc_cal_request;  // Set to recalibrate the offset once the acquisition stopped
+static atomic_t adc_cal_gap_us;  // Acquisition gap of the last calibration
+static atomic_t adc_cal_gap_max_us;  // Longest acquisition gap of a calibration
+static atomic_t adc_cal_block_us;  // Block period in force at the last calibration, bound of the gap
+static int adc_offset_channel = -1;  // Spare SAADC channel measuring the offset, -1 if none
+
+/**
+ * @brief Timer expiry function asking for an offset recalibration at the next block boundary.
+ *
+ * @param timer Pointer to the timer that expired.
+ */
+static void adc_cal_timer_expiry(struct k_timer *timer) {
+    atomic_set(&adc_cal_request, 1);
+    atomic_set(&adc_restart, 1);
+}
+
+K_TIMER_DEFINE(adc_cal_timer, adc_cal_timer_expiry, NULL);
+
+// The sampler runs in the ADC callback, so its queue must not block by default
+PIPELINE_QUEUE_DEFINE(queue_adc_raw, QUEUE_ADC_RAW_DEPTH, QUEUE_DROP_OLDEST);  // Blocks of raw ADC data
+#if PIPELINE_FUSED
+static PipelineQueue *const pipeline_queues[] = { &queue_adc_raw };
+#else
+PIPELINE_QUEUE_DEFINE(queue_sensor_data, QUEUE_SENSOR_DATA_DEPTH, QUEUE_BLOCK);  // Blocks of processed sensor data
+
+static PipelineQueue *const pipeline_queues[] = { &queue_adc_raw, &queue_sensor_data };
+#endif
+
+static SensorCalibration sensor_calibrations[SENSOR_CHANNEL_COUNT] = {
+    [0 ... SENSOR_CHANNEL_COUNT - 1] = { .gain_fract = CAL_GAIN_ONE },
+};
+static struct k_spinlock calibration_lock;  // Guards sensor_calibrations against the UART
+static atomic_t calibration_raw_mean[SENSOR_CHANNEL_COUNT];  // Last block mean before calibration, CAL_LUT_Q
+
+static void calibration_save_handler(struct k_work *work);
+K_WORK_DEFINE(calibration_save_work, calibration_save_handler);
+
+// Two-point calibration in progress, only touched from uart_command_thread
+static int calibration_channel = -1;
+static int calibration_points;
+static int32_t calibration_raw[2];  // Uncalibrated block means, CAL_LUT_Q
+static int32_t calibration_ref[2];  // Reference values, milli-units
+
+/**
+ * @brief Starts the two-point calibration of a channel.
+ *
+ * @param channel Analog channel.
+ */
+static void calibration_start(int channel) {
+    calibration_channel = channel;
+    calibration_points = 0;
+}
+
+/**
+ * @brief Takes a calibration point: the current input of the channel is known to be @p reference.
+ *
+ * The first point is only recorded. The second one solves the gain and offset mapping both
+ * uncalibrated means onto their references, applies them from the next block and saves them
+ * to flash.
+ *
+ * @param reference True value of the input, in milli-units.
+ * @return int 1 after the first point, 0 once calibrated, otherwise a negative error code.
+ */
+static int calibration_capture(int32_t reference) {
+    if (calibration_channel < 0) {
+        return -EINVAL;
+    }
+    calibration_raw[calibration_points] = atomic_get(&calibration_raw_mean[calibration_channel]);
+    calibration_ref[calibration_points] = reference;
+    if (++calibration_points < 2) {
+        return 1;
+    }
+
+    int channel = calibration_channel;
+    int32_t raw_span = calibration_raw[1] - calibration_raw[0];
+    int64_t ref_span = calibration_ref[1] - calibration_ref[0];
+    calibration_channel = -1;
+    if (raw_span == 0) {
+        return -EINVAL;
+    }
+    // gain = ref_span / (raw_span / 2^CAL_LUT_Q), as a factor of 2^30
+    int64_t gain_fract = (ref_span << (30 + CAL_LUT_Q)) / raw_span;
+    if (gain_fract <= 0 || gain_fract > INT32_MAX) {
+        return -ERANGE;
+    }
+
+    SensorCalibration cal = { .gain_fract = gain_fract };
+    cal.offset = calibration_ref[0] - calibration_apply(&cal, calibration_raw[0]);
+
+    k_spinlock_key_t key = k_spin_lock(&calibration_lock);
+    sensor_calibrations[channel] = cal;
+    k_spin_unlock(&calibration_lock, key);
+    k_work_submit(&calibration_save_work);
+    return 0;
+}
+
+/**
+ * @brief Drops the two-point calibration of a channel and saves the change.
+ *
+ * @param channel Analog channel.
+ */
+static void calibration_reset(int channel) {
+    k_spinlock_key_t key = k_spin_lock(&calibration_lock);
+    sensor_calibrations[channel] = (SensorCalibration){ .gain_fract = CAL_GAIN_ONE };
+    k_spin_unlock(&calibration_lock, key);
+    k_work_submit(&calibration_save_work);
+}
+
+#define FILTER_MA_LEN          8       // Samples averaged by the moving average
+#define FILTER_MEDIAN_LEN      5       // Window of the median spike filter, must be odd
+#define FILTER_EWMA_SHIFT      3       // A new sample weighs 1/2^FILTER_EWMA_SHIFT in the EWMA
+#define FILTER_EWMA_Q          8       // Fraction bits of the EWMA state
+
+/**
+ * @brief Filters that can be selected for a channel.
+ */
+typedef enum {
+    FILTER_NONE,            ///< Samples pass unchanged.
+    FILTER_MOVING_AVERAGE,  ///< Mean of the last FILTER_MA_LEN samples.
+    FILTER_MEDIAN,          ///< Median of the last FILTER_MEDIAN_LEN samples, rejects single spikes.
+    FILTER_EWMA,            ///< First-order IIR low-pass.
+    FILTER_FIR,             ///< FIR low-pass with the dsp_fir_coeffs table.
+    FILTER_TYPE_COUNT
+} FilterType;
+
+static const char *const filter_names[FILTER_TYPE_COUNT] = {
+    "none", "average", "median", "ewma", "fir",
+};
+
+/**
+ * @struct ChannelFilter
+ * @brief Filter of one analog channel and its state, carried over from block to block.
+ */
+typedef struct {
+    FilterType type;  ///< Selected filter.
+    bool primed;  ///< The state has been seeded with the first sample.
+    union {
+        struct {
+            int32_t window[FILTER_MA_LEN];
+            int32_t sum;  ///< Sum of the window.
+            uint8_t next;  ///< Slot of the oldest sample.
+        } average;
+        struct {
+            int32_t window[FILTER_MEDIAN_LEN];
+            uint8_t next;  ///< Slot of the oldest sample.
+        } median;
+        struct {
+            int32_t value_q;  ///< Filter output with FILTER_EWMA_Q fraction bits.
+        } ewma;
+        DspFir fir;
+    };
+} ChannelFilter;
+
+#define FILTER_DEFAULT         FILTER_FIR  // Filter of every channel at boot
+
+static ChannelFilter channel_filters[SENSOR_CHANNEL_COUNT];
+// Filter requested for each channel from the UART, plus one (0: no request)
+static atomic_t channel_filter_requests[SENSOR_CHANNEL_COUNT];
+
+/**
+ * @brief Selects a filter and clears its state.
+ *
+ * @param filter Channel filter.
+ * @param type Filter to use from now on.
+ */
+static void filter_reset(ChannelFilter *filter, FilterType type) {
+    memset(filter, 0, sizeof(*filter));
+    filter->type = type;
+    if (type == FILTER_FIR) {
+        dsp_fir_init(&filter->fir);
+    }
+}
+
+/**
+ * @brief Fills the filter history with one sample, so the output starts without a transient.
+ *
+ * @param filter Channel filter.
+ * @param value First sample seen by the filter.
+ */
+static void filter_prime(ChannelFilter *filter, int32_t value) {
+    switch (filter->type) {
+        case FILTER_MOVING_AVERAGE:
+            for (int i = 0; i < FILTER_MA_LEN; i++) {
+                filter->average.window[i] = value;
+            }
+            filter->average.sum = value * FILTER_MA_LEN;
+            break;
+        case FILTER_MEDIAN:
+            for (int i = 0; i < FILTER_MEDIAN_LEN; i++) {
+                filter->median.window[i] = value;
+            }
+            break;
+        case FILTER_EWMA:
+            filter->ewma.value_q = value * (1 << FILTER_EWMA_Q);
+            break;
+        case FILTER_FIR:
+            for (int i = 0; i < DSP_FIR_TAPS - 1; i++) {
+                filter->fir.state[i] = value;  // Delay line of both the CMSIS-DSP and the C kernel
+            }
+            break;
+        default:
+            break;
+    }
+    filter->primed = true;
+}
+
+/**
+ * @brief Returns the median of the median filter window.
+ */
+static int32_t filter_median(const ChannelFilter *filter) {
+    int32_t sorted[FILTER_MEDIAN_LEN];
+
+    // Insertion sort, the window is only a few samples long
+    for (int i = 0; i < FILTER_MEDIAN_LEN; i++) {
+        int32_t value = filter->median.window[i];
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > value; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = value;
+    }
+    return sorted[FILTER_MEDIAN_LEN / 2];
+}
+
+/**
+ * @brief Runs a block of samples through the filter of a channel.
+ *
+ * @param filter Channel filter.
+ * @param in Input samples.
+ * @param out Filtered samples, may not alias @p in.
+ * @param count Number of samples.
+ */
+static void filter_block(ChannelFilter *filter, const int32_t *in, int32_t *out, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (!filter->primed) {
+        filter_prime(filter, in[0]);
+    }
+
+    switch (filter->type) {
+        case FILTER_MOVING_AVERAGE:
+            for (uint32_t i = 0; i < count; i++) {
+                uint8_t slot = filter->average.next;
+                filter->average.sum += in[i] - filter->average.window[slot];
+                filter->average.window[slot] = in[i];
+                filter->average.next = (slot + 1) % FILTER_MA_LEN;
+                out[i] = filter->average.sum / FILTER_MA_LEN;
+            }
+            break;
+        case FILTER_MEDIAN:
+            for (uint32_t i = 0; i < count; i++) {
+                filter->median.window[filter->median.next] = in[i];
+                filter->median.next = (filter->median.next + 1) % FILTER_MEDIAN_LEN;
+                out[i] = filter_median(filter);
+            }
+            break;
+        case FILTER_EWMA:
+            for (uint32_t i = 0; i < count; i++) {
+                filter->ewma.value_q += (in[i] * (1 << FILTER_EWMA_Q) - filter->ewma.value_q) >> FILTER_EWMA_SHIFT;
+                out[i] = filter->ewma.value_q >> FILTER_EWMA_Q;
+            }
+            break;
+        case FILTER_FIR:
+            dsp_fir_q31(&filter->fir, in, out, count);
+            break;
+        default:
+            memcpy(out, in, count * sizeof(*out));
+            break;
+    }
+}
+
+/**
+ * @brief Applies a filter change requested from the UART, at a block boundary.
+ *
+ * @param channel Analog channel.
+ * @return ChannelFilter* Filter to run on the next block of the channel.
+ */
+static ChannelFilter *filter_for_channel(int channel) {
+    ChannelFilter *filter = &channel_filters[channel];
+    atomic_val_t request = atomic_clear(&channel_filter_requests[channel]);
+
+    if (request != 0) {
+        filter_reset(filter, request - 1);
+    }
+    return filter;
+}
+
+#define DEADBAND_INIT(idx, prop, default_value) ATOMIC_INIT(SENSOR_DT_PARAM(idx, prop, default_value))
+
+// Report-by-exception settings, written by the UART and read by the database stage at each block
+static atomic_t deadband_absolute[SENSOR_CHANNEL_COUNT] = {
+    LISTIFY(SENSOR_CHANNEL_COUNT, DEADBAND_INIT, (,), sensor_deadband, DEADBAND_DEFAULT)
+};
+static atomic_t deadband_permille[SENSOR_CHANNEL_COUNT] = {
+    LISTIFY(SENSOR_CHANNEL_COUNT, DEADBAND_INIT, (,), sensor_deadband_permille, DEADBAND_DEFAULT_PERMILLE)
+};
+static atomic_t heartbeat_ms[SENSOR_CHANNEL_COUNT] = {
+    LISTIFY(SENSOR_CHANNEL_COUNT, DEADBAND_INIT, (,), sensor_heartbeat_ms, HEARTBEAT_DEFAULT_MS)
+};
 
-// Define message queues
-K_MSGQ_DEFINE(msgq_adc_raw, sizeof(int16_t), 10, 4); // Queue for raw ADC data
-K_MSGQ_DEFINE(msgq_temperature, sizeof(float), 10, 4); // Queue for processed temperature data
-K_MSGQ_DEFINE(msgq_sensor_data, sizeof(SensorData), 10, 4); // Queue for sensor data including raw and temperature
+/**
+ * @struct ChannelReport
+ * @brief Report-by-exception state of a channel, owned by the database stage.
+ */
+typedef struct {
+    bool valid;  ///< @c value has been reported at least once.
+    int32_t value;  ///< Last value written to the RTDB.
+    int64_t timestamp_us;  ///< Acquisition time of the last reported block.
+    atomic_t reports;  ///< Blocks written to the RTDB because of a change.
+    atomic_t heartbeats;  ///< Blocks written to the RTDB because the channel was silent too long.
+    atomic_t suppressed;  ///< Blocks that stayed inside the deadband.
+} ChannelReport;
 
+static ChannelReport channel_reports[SENSOR_CHANNEL_COUNT];
 
+/**
+ * @brief Decides whether a block of a channel is reported to the RTDB.
+ *
+ * Every sample of the block is checked against the deadband, so a short excursion inside a
+ * block is not lost even though only the latest sample is stored. The band is the larger of the
+ * absolute and the relative deadband.
+ *
+ * @param report Report state of the channel.
+ * @param channel Analog channel, for its settings.
+ * @param value Filtered samples of the block.
+ * @param count Number of samples.
+ * @param timestamp_us Acquisition time of the block.
+ * @return int 0 to suppress the block, 1 if it changed, 2 if it is a heartbeat of an unchanged value.
+ */
+static int channel_report_check(ChannelReport *report, int channel, const int32_t *value, uint32_t count,
+                                int64_t timestamp_us) {
+    if (!report->valid) {
+        atomic_inc(&report->reports);
+        return 1;
+    }
+
+    int64_t band = MAX((int64_t)atomic_get(&deadband_absolute[channel]),
+                       llabs(report->value) * atomic_get(&deadband_permille[channel]) / 1000);
+    for (uint32_t i = 0; i < count; i++) {
+        if (llabs((int64_t)value[i] - report->value) > band) {
+            atomic_inc(&report->reports);
+            return 1;
+        }
+    }
+
+    int32_t heartbeat = atomic_get(&heartbeat_ms[channel]);
+    if (heartbeat > 0 && timestamp_us - report->timestamp_us >= (int64_t)heartbeat * USEC_PER_MSEC) {
+        atomic_inc(&report->heartbeats);
+        return 2;
+    }
+    atomic_inc(&report->suppressed);
+    return 0;
+}
+
+/**
+ * @brief Records that a value of a channel was written to the RTDB.
+ */
+static void channel_report_update(ChannelReport *report, int32_t value, int64_t timestamp_us) {
+    report->valid = true;
+    report->value = value;
+    report->timestamp_us = timestamp_us;
+}
+
+// Pipeline throughput, counted when blocks reach the database
+static atomic_t pipeline_samples;
+static atomic_t pipeline_blocks;
+static atomic_t pipeline_gaps;  // Blocks missing from the sequence numbering
+
+#define ADC_MODE_COUNT         (((ADC_RESOLUTION_MAX - ADC_RESOLUTION_MIN) / 2 + 1) * (ADC_OVERSAMPLING_MAX + 1))
+#define ADC_MODE_INDEX(resolution, oversampling) \
+    (((resolution) - ADC_RESOLUTION_MIN) / 2 * (ADC_OVERSAMPLING_MAX + 1) + (oversampling))
+
+/**
+ * @struct AdcModeStats
+ * @brief Throughput and noise measured for one resolution and oversampling mode.
+ *
+ * Noise is the standard deviation of the unfiltered temperature, so it is only meaningful on
+ * a constant input. Sums are kept relative to the first sample of the mode to stay small.
+ */
+typedef struct {
+    uint32_t samples;  ///< Samples taken in this mode.
+    uint32_t timed_samples;  ///< Samples of the blocks followed by another block in this mode.
+    int64_t elapsed_us;  ///< Time between the first and the last of those blocks.
+    int32_t reference;  ///< First sample, in mdegC.
+    int64_t sum;  ///< Sum of the deviations from @c reference.
+    uint64_t sum_sq;  ///< Sum of the squared deviations from @c reference.
+} AdcModeStats;
+
+static AdcModeStats adc_mode_stats[ADC_MODE_COUNT];
+static struct k_spinlock adc_mode_stats_lock;
+
+/**
+ * @brief Adds a block to the statistics of the mode it was acquired in. Called by the database stage.
+ *
+ * @param info Metadata of the block.
+ * @param temperature Unfiltered temperatures of the block, in mdegC.
+ */
+static void adc_mode_stats_update(const BlockInfo *info, const int32_t *temperature) {
+    static int last_mode = -1;
+    static int64_t last_timestamp_us;
+    static uint16_t last_count;
+    int mode = ADC_MODE_INDEX(info->resolution, info->oversampling);
+    AdcModeStats *stats = &adc_mode_stats[mode];
+    int32_t reference = stats->samples != 0 ? stats->reference : temperature[0];
+    int64_t sum = 0;
+    uint64_t sum_sq = 0;
+
+    for (int i = 0; i < info->count; i++) {
+        int64_t deviation = temperature[i] - reference;
+        sum += deviation;
+        sum_sq += deviation * deviation;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&adc_mode_stats_lock);
+    stats->reference = reference;
+    stats->samples += info->count;
+    stats->sum += sum;
+    stats->sum_sq += sum_sq;
+    if (mode == last_mode) {
+        stats->timed_samples += last_count;
+        stats->elapsed_us += info->timestamp_us - last_timestamp_us;
+    }
+    k_spin_unlock(&adc_mode_stats_lock, key);
+
+    last_mode = mode;
+    last_timestamp_us = info->timestamp_us;
+    last_count = info->count;
+}
+
+/**
+ * @brief Formats the throughput and noise of every mode that has been used.
+ *
+ * @param buf Output buffer.
+ * @param size Size of @p buf.
+ * @return size_t Length written, not counting the terminator.
+ */
+static size_t adc_mode_stats_format(char *buf, size_t size) {
+    size_t len = 0;
+
+    for (int mode = 0; mode < ADC_MODE_COUNT && len < size; mode++) {
+        k_spinlock_key_t key = k_spin_lock(&adc_mode_stats_lock);
+        AdcModeStats stats = adc_mode_stats[mode];
+        k_spin_unlock(&adc_mode_stats_lock, key);
+        if (stats.samples == 0) {
+            continue;
+        }
+
+        uint32_t rate = stats.elapsed_us > 0 ? (uint64_t)stats.timed_samples * USEC_PER_SEC / stats.elapsed_us : 0;
+        int64_t mean = stats.sum / stats.samples;
+        uint64_t variance = stats.samples > 1 ?
+                            (stats.sum_sq - (uint64_t)(mean * stats.sum)) / (stats.samples - 1) : 0;
+        len += snprintf(buf + len, size - len, "%ub x%u: %u samples %u samples/s sd %u mdegC\r\n",
+                        ADC_RESOLUTION_MIN + mode / (ADC_OVERSAMPLING_MAX + 1) * 2,
+                        (unsigned)BIT(mode % (ADC_OVERSAMPLING_MAX + 1)), stats.samples, rate, isqrt64(variance));
+    }
+    return MIN(len, size - 1);
+}
+
+/**
+ * @brief Legs of the path of a block from the sampler into the RTDB.
+ */
+typedef enum {
+    LATENCY_QUEUE_RAW,     ///< Waiting in queue_adc_raw.
+    LATENCY_PROCESS,       ///< Conversion, filtering and rate control.
+    LATENCY_QUEUE_SENSOR,  ///< Waiting in queue_sensor_data.
+    LATENCY_DATABASE,      ///< Deadband checks and the RTDB commit.
+    LATENCY_TOTAL,         ///< Completion of the block to the RTDB commit.
+    LATENCY_STAGE_COUNT
+} LatencyStage;
+
+static const char *const latency_stage_names[LATENCY_STAGE_COUNT] = {
+    "queue_raw", "process", "queue_sensor", "database", "total",
+};
+
+/**
+ * @struct StageLatency
+ * @brief Time blocks spent in one leg of the pipeline, in cycles of the timing API.
+ */
+typedef struct {
+    uint32_t count;  ///< Blocks measured.
+    uint32_t last;  ///< Latest block.
+    uint32_t max;  ///< Slowest block.
+    uint64_t sum;  ///< Sum over all blocks, for the average.
+} StageLatency;
+
+static StageLatency stage_latency[LATENCY_STAGE_COUNT];
+static struct k_spinlock stage_latency_lock;
+
+/**
+ * @brief Adds the stage times of a block once it is in the RTDB. Called by the database stage.
+ *
+ * @param info Metadata of the block, with the sampler and processing stamps.
+ * @param dequeued Cycle counter when the database stage took the block.
+ * @param stored Cycle counter after the RTDB commit.
+ */
+static void stage_latency_update(BlockInfo *info, timing_t dequeued, timing_t stored) {
+    uint64_t cycles[LATENCY_STAGE_COUNT] = {
+        [LATENCY_QUEUE_RAW] = timing_cycles_get(&info->acquired, &info->dequeued),
+        [LATENCY_PROCESS] = timing_cycles_get(&info->dequeued, &info->processed),
+        [LATENCY_QUEUE_SENSOR] = timing_cycles_get(&info->processed, &dequeued),
+        [LATENCY_DATABASE] = timing_cycles_get(&dequeued, &stored),
+        [LATENCY_TOTAL] = timing_cycles_get(&info->acquired, &stored),
+    };
+
+    k_spinlock_key_t key = k_spin_lock(&stage_latency_lock);
+    for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+        StageLatency *latency = &stage_latency[stage];
+        latency->last = MIN(cycles[stage], UINT32_MAX);
+        latency->max = MAX(latency->max, latency->last);
+        latency->sum += latency->last;
+        latency->count++;
+    }
+    k_spin_unlock(&stage_latency_lock, key);
+}
+
+/**
+ * @brief Formats the last, average and worst time of every stage, in microseconds.
+ *
+ * @param buf Output buffer.
+ * @param size Size of @p buf.
+ * @return size_t Length written, not counting the terminator.
+ */
+static size_t stage_latency_format(char *buf, size_t size) {
+    size_t len = snprintf(buf, size, "Latency us (last/avg/max):");
+
+    for (int stage = 0; stage < LATENCY_STAGE_COUNT && len < size; stage++) {
+        k_spinlock_key_t key = k_spin_lock(&stage_latency_lock);
+        StageLatency latency = stage_latency[stage];
+        k_spin_unlock(&stage_latency_lock, key);
+
+        uint64_t average = latency.count ? latency.sum / latency.count : 0;
+        len += snprintf(buf + len, size - len, " %s %u/%u/%u", latency_stage_names[stage],
+                        (unsigned)(timing_cycles_to_ns(latency.last) / NSEC_PER_USEC),
+                        (unsigned)(timing_cycles_to_ns(average) / NSEC_PER_USEC),
+                        (unsigned)(timing_cycles_to_ns(latency.max) / NSEC_PER_USEC));
+    }
+    if (len < size) {
+        len += snprintf(buf + len, size - len, "\r\n");
+    }
+    return MIN(len, size - 1);
+}
+
+// Adaptive sampling settings, written by the UART. A zero ceiling disables the controller.
+static atomic_t adaptive_max_hz = ATOMIC_INIT(ADAPTIVE_MAX_HZ);
+static atomic_t adaptive_slope = ATOMIC_INIT(ADAPTIVE_SLOPE);
+static atomic_t adaptive_stddev = ATOMIC_INIT(ADAPTIVE_STDDEV);
+// Rate transitions and the samples they saved, for the 'q' UART command
+static atomic_t adaptive_steps_up;
+static atomic_t adaptive_steps_down;
+static atomic_t adaptive_samples;  // Samples acquired while the controller was enabled
+static atomic_t adaptive_samples_at_max;  // Samples the ceiling rate would have taken over the same time
+
+/**
+ * @brief Sample period the acquisition actually runs at for a requested rate.
+ *
+ * The SAADC driver paces the sequence with a k_timer, whose period is the requested interval
+ * rounded up to whole system ticks (30.5 us at 32768 Hz), so most rates above a few hundred
+ * Hz run slower than requested: 20 kHz runs at 16384 Hz.
+ *
+ * @param rate Requested rate in Hz.
+ * @return uint32_t Period in system ticks.
+ */
+static inline uint32_t adc_rate_ticks(uint32_t rate) {
+    return MAX(k_us_to_ticks_ceil32(USEC_PER_SEC / rate), 1);
+}
+
+/**
+ * @brief Sample period of the acquisition for a requested rate and oversampling.
+ *
+ * This is the tick-rounded timer period, unless converting the scan takes longer: every
+ * sample takes 2^oversampling scans, and the driver starts a late sample as soon as the
+ * previous one is done.
+ *
+ * @param rate Requested rate in Hz.
+ * @param oversampling log2 of the conversions averaged into each sample.
+ * @return uint32_t Period in microseconds.
+ */
+static inline uint32_t adc_sample_period_us(uint32_t rate, uint8_t oversampling) {
+    return MAX(k_ticks_to_us_near32(adc_rate_ticks(rate)), adc_scan_us << oversampling);
+}
+
+/**
+ * @brief Rate the acquisition actually runs at for a requested rate, see adc_sample_period_us().
+ *
+ * @param rate Requested rate in Hz.
+ * @param oversampling log2 of the conversions averaged into each sample.
+ * @return uint32_t Effective rate in Hz, rounded down.
+ */
+static inline uint32_t adc_effective_rate_hz(uint32_t rate, uint8_t oversampling) {
+    uint32_t timer_hz = CONFIG_SYS_CLOCK_TICKS_PER_SEC / adc_rate_ticks(rate);
+    uint32_t scan_us = adc_scan_us << oversampling;
+
+    return scan_us > 0 ? MIN(timer_hz, USEC_PER_SEC / scan_us) : timer_hz;
+}
+
+/**
+ * @brief Switches the acquisition to a new rate at the next block boundary.
+ *
+ * @param rate Rate in Hz.
+ */
+static void adc_set_rate(uint32_t rate) {
+    atomic_set(&adc_rate_hz, rate);
+    atomic_set(&adc_restart, 1);  // Applied at the next block boundary
+}
+
+/**
+ * @brief Adapts the acquisition rate to the dynamics of channel 0. Called by the processing stage.
+ *
+ * A block whose mean moved faster than adaptive_slope since the previous block, or whose
+ * samples spread more than adaptive_stddev, multiplies the rate by ADAPTIVE_STEP up to the
+ * ceiling. After ADAPTIVE_HOLD_MS without either, the rate is divided by ADAPTIVE_STEP down
+ * to the base rate. Both thresholds must sit above the noise of the channel. Blocks acquired
+ * before the last rate change are only accounted, so a step is judged on its own samples.
+ *
+ * @param info Metadata of the block, with the mean already set.
+ * @param value Unfiltered values of channel 0.
+ */
+static void adaptive_rate_update(const BlockInfo *info, const int32_t *value) {
+    static bool primed;
+    static int32_t last_mean;
+    static int64_t steady_us;
+    uint32_t max_hz = atomic_get(&adaptive_max_hz);
+    uint32_t rate = atomic_get(&adc_rate_hz);
+    int64_t duration_us = (int64_t)info->count * info->period_us;
+
+    if (max_hz == 0) {
+        primed = false;
+        return;
+    }
+    atomic_add(&adaptive_samples, info->count);
+    atomic_add(&adaptive_samples_at_max, duration_us * max_hz / USEC_PER_SEC);
+    if (info->period_us != adc_sample_period_us(rate, info->oversampling)) {
+        primed = false;  // Block from before the last rate change
+        return;
+    }
+
+    int64_t slope = atomic_get(&adaptive_slope);
+    int64_t stddev = atomic_get(&adaptive_stddev);
+    uint64_t sum_sq = 0;
+    for (int i = 0; i < info->count; i++) {
+        int64_t deviation = value[i] - info->mean;
+        sum_sq += deviation * deviation;
+    }
+    bool moving = sum_sq > (uint64_t)(stddev * stddev) * info->count ||
+                  (primed && llabs((int64_t)info->mean - last_mean) * USEC_PER_SEC > slope * duration_us);
+    primed = true;
+    last_mean = info->mean;
+
+    if (moving) {
+        steady_us = 0;
+        if (rate < max_hz) {
+            atomic_inc(&adaptive_steps_up);
+            adc_set_rate(MIN(rate * ADAPTIVE_STEP, max_hz));
+        }
+        return;
+    }
+    steady_us += duration_us;
+    uint32_t base = atomic_get(&adc_base_rate_hz);
+    if (steady_us >= ADAPTIVE_HOLD_MS * USEC_PER_MSEC && rate > base) {
+        steady_us = 0;
+        atomic_inc(&adaptive_steps_down);
+        adc_set_rate(MAX(rate / ADAPTIVE_STEP, base));
+    }
+}
 
 // Thread data and stacks
 K_THREAD_STACK_DEFINE(sensor_stack, 1024);
 struct k_thread sensor_thread_data;
 
+#if !PIPELINE_FUSED
 K_THREAD_STACK_DEFINE(process_stack, 1024);
 struct k_thread process_thread_data;
 
 K_THREAD_STACK_DEFINE(database_stack, 1024);
 struct k_thread database_thread_data;
+#endif
+
+K_THREAD_STACK_DEFINE(checkpoint_stack, 1024);
+struct k_thread checkpoint_thread_data;
+
+#if PIPELINE_FUSED
+// Fused pipeline: one work item per block replaces the processing and database threads
+K_THREAD_STACK_DEFINE(pipeline_work_stack, 2048);
+static struct k_work_q pipeline_work_q;
+static void pipeline_work_handler(struct k_work *work);
+K_WORK_DEFINE(pipeline_work, pipeline_work_handler);
+#endif
 
 // Function prototypes
 void sensor_reading_thread(void *p1, void *p2, void *p3);
 void data_processing_thread(void *p1, void *p2, void *p3);
 void database_thread(void *p1, void *p2, void *p3);
+void checkpoint_thread(void *p1, void *p2, void *p3);
 
 
 
@@ -125,91 +1034,439 @@ static void configure_buttons_and_leds(void) {
     gpio_pin_configure_dt(&led3, GPIO_OUTPUT_ACTIVE);
 }
 
+// Toggle-to-GPIO latency of the LED path, measured with the cycle counter
+static volatile uint32_t led_toggle_cycles;
+static atomic_t led_toggle_pending;  // Set by a toggle command, cleared once its latency is recorded
+static volatile uint32_t led_latency_last_us;
+static volatile uint32_t led_latency_max_us;
+
 const struct device *uart = DEVICE_DT_GET(DT_NODELABEL(uart0));
 static uint8_t tx_buf[] = "xxxxxxxxxxxxxx Welcome xxxxxxxxxxxxxx\n\r";
 static uint8_t rx_buf[RECEIVE_BUFF_SIZE] = {0};
 
 
 /**
- * @brief UART event callback function to handle incoming data and control device peripherals.
+ * @brief Executes a UART command and formats its reply. Runs in uart_command_thread.
+ *
+ * @param req Command and its argument, as parsed by uart_callback().
+ * @param output Reply buffer.
+ * @param size Size of @p output.
+ * @return size_t Length of the reply, 0 to send nothing.
+ */
+static size_t uart_command_execute(const UartRequest *req, char *output, size_t size) {
+    uint8_t cmd = req->cmd;
+    uint32_t arg = req->arg;
+    uint32_t arg_scale = req->arg_scale;
+    bool arg_negative = req->negative;
+
+    if (cmd == 'p' && arg < RTDB_POINT_COUNT) {
+        int64_t timestamp_us;
+        int32_t value = rtdb_get_timed(arg, &timestamp_us);
+        int len = snprintf(output, size, "Point %u ", (unsigned)arg);
+        len += rtdb_point_format(output + len, size - len, arg, value);
+        snprintf(output + len, size - len, " age=%uus\r\n", rtdb_sample_age_us(timestamp_us));
+#if RTDB_LOCK_STATS
+    } else if (cmd == 'k' && arg < RTDB_SITE_COUNT) {
+        const RtdbLockStats *stats = &rtdb_lock_stats[arg];
+        size_t len = snprintf(output, size, "Lock %s: acq=%u hold_max=%u cyc read_retries=%u\r\nhold:",
+                              rtdb_site_names[arg], stats->acquisitions, stats->hold_max,
+                              (unsigned)atomic_get(&stats->read_retries));
+        for (int b = 0; b < RTDB_LOCK_HIST_BUCKETS && len < size; b++) {
+            len += snprintf(output + len, size - len, " %u", stats->hold_hist[b]);
+        }
+        snprintf(output + MIN(len, size - 3), 3, "\r\n");
+#endif
+    } else if (cmd == 'r') {
+        uint32_t rate = CLAMP(arg, ADC_RATE_MIN_HZ, ADC_RATE_MAX_HZ);
+        atomic_set(&adc_base_rate_hz, rate);
+        adc_set_rate(rate);
+        snprintf(output, size, "Sample rate: %u Hz (runs at %u Hz) overruns: %u\r\n",
+                 rate, adc_effective_rate_hz(rate, atomic_get(&adc_oversampling)),
+                 (unsigned)atomic_get(&adc_overruns));
+    } else if (cmd == 'f' && arg / 10 < SENSOR_CHANNEL_COUNT && arg % 10 < FILTER_TYPE_COUNT) {
+        atomic_set(&channel_filter_requests[arg / 10], arg % 10 + 1);  // Applied at the next block
+        snprintf(output, size, "Channel %u filter: %s\r\n",
+                 (unsigned)(arg / 10), filter_names[arg % 10]);
+    } else if (cmd == 'm' && arg / 10 >= ADC_RESOLUTION_MIN && arg / 10 <= ADC_RESOLUTION_MAX &&
+               arg / 10 % 2 == 0 && arg % 10 <= ADC_OVERSAMPLING_MAX &&
+               (arg % 10 == 0 || SENSOR_CHANNEL_COUNT == 1)) {  // SAADC oversamples a single channel only
+        atomic_set(&adc_resolution, arg / 10);
+        atomic_set(&adc_oversampling, arg % 10);
+        atomic_set(&adc_restart, 1);  // Applied at the next block boundary
+        snprintf(output, size, "ADC mode: %u bits, %u x oversampling\r\n",
+                 (unsigned)(arg / 10), (unsigned)BIT(arg % 10));
+    } else if (cmd == 'x' && arg < SENSOR_CHANNEL_COUNT) {
+        calibration_start(arg);
+        snprintf(output, size, "Calibrating channel %u, send y<value> at two points\r\n",
+                 (unsigned)arg);
+    } else if (cmd == 'y') {
+        int32_t reference = arg_negative ? -(int32_t)arg : (int32_t)arg;
+        int ret = calibration_capture(reference);
+        if (ret == 1) {
+            snprintf(output, size, "Calibration point 1: %d\r\n", reference);
+        } else if (ret == 0) {
+            snprintf(output, size, "Calibration point 2: %d, saved\r\n", reference);
+        } else {
+            snprintf(output, size, "Calibration failed: %d\r\n", ret);
+        }
+    } else if (cmd == 'z' && arg < SENSOR_CHANNEL_COUNT) {
+        calibration_reset(arg);
+        snprintf(output, size, "Channel %u calibration reset\r\n", (unsigned)arg);
+    } else if ((cmd == 'w' || cmd == 'v' || cmd == 's') && arg_scale >= 10 &&
+               arg / arg_scale < SENSOR_CHANNEL_COUNT) {
+        // <channel digit><value>
+        uint32_t channel = arg / arg_scale;
+        uint32_t value = MIN(arg % arg_scale, INT32_MAX);
+        atomic_set(cmd == 'w' ? &deadband_absolute[channel] :
+                   cmd == 'v' ? &deadband_permille[channel] : &heartbeat_ms[channel], value);
+        snprintf(output, size, "Channel %u deadband: %d abs %d.%d%% heartbeat %d ms\r\n",
+                 (unsigned)channel, (int)atomic_get(&deadband_absolute[channel]),
+                 (int)atomic_get(&deadband_permille[channel]) / 10,
+                 (int)atomic_get(&deadband_permille[channel]) % 10,
+                 (int)atomic_get(&heartbeat_ms[channel]));
+    } else if (cmd == 'g') {
+        // g<ceiling in Hz>, g0 goes back to the fixed base rate
+        uint32_t max_hz = arg == 0 ? 0 : CLAMP(arg, atomic_get(&adc_base_rate_hz), ADC_RATE_MAX_HZ);
+        atomic_set(&adaptive_max_hz, max_hz);
+        if (max_hz == 0) {
+            adc_set_rate(atomic_get(&adc_base_rate_hz));
+        }
+        snprintf(output, size, "Adaptive sampling: %u..%u Hz\r\n",
+                 (unsigned)atomic_get(&adc_base_rate_hz), max_hz);
+    } else if (cmd == 'u') {
+        atomic_set(&adaptive_slope, MIN(arg, INT32_MAX));
+        snprintf(output, size, "Adaptive slope threshold: %u mdegC/s\r\n", (unsigned)arg);
+    } else if (cmd == 'o') {
+        atomic_set(&adaptive_stddev, MIN(arg, INT32_MAX));
+        snprintf(output, size, "Adaptive noise threshold: %u mdegC\r\n", (unsigned)arg);
+    } else if (cmd == 'j' && arg / 10 < ARRAY_SIZE(pipeline_queues) && arg % 10 < QUEUE_POLICY_COUNT) {
+        PipelineQueue *queue = pipeline_queues[arg / 10];
+        atomic_set(&queue->policy, arg % 10);
+        pipeline_queue_format(output, size, queue);
+    } else if (cmd == 'd') {
+        IoModuleData delta;
+        uint32_t generation[RTDB_POINT_COUNT];
+        uint32_t version;
+        uint32_t changed = rtdb_changed_since(arg, &delta, generation, &version);
+        // Points are laid out after room for the header, which needs the final version.
+        // A point that does not fit is left for the next query: the version returned
+        // is then just below its change, so passing it back sends that point again.
+        char header[32];
+        size_t start = sizeof(header);
+        size_t len = start;
+        uint32_t resume = version;
+        for (int id = 0; id < RTDB_POINT_COUNT; id++) {
+            if (!(changed & RTDB_FIELD(id))) {
+                continue;
+            }
+            char item[64];
+            int n = snprintf(item, sizeof(item), " ");
+            n += rtdb_point_format(item + n, sizeof(item) - n, id, delta.points[id]);
+            n += snprintf(item + n, sizeof(item) - n, "@%uus",
+                          rtdb_sample_age_us(delta.timestamp_us[id]));
+            if (n >= (int)sizeof(item) || len + n > size - 3) {
+                resume = MIN(resume, generation[id] - 1);
+                continue;
+            }
+            memcpy(output + len, item, n);
+            len += n;
+        }
+        int header_len = snprintf(header, sizeof(header), "Version %u%s:", resume,
+                                  resume != version ? " (more)" : "");
+        memmove(output + header_len, output + start, len - start);
+        memcpy(output, header, header_len);
+        len = header_len + len - start;
+        snprintf(output + len, size - len, "\r\n");
+    } else if (cmd >= '1' && cmd <= '4') {
+        int led_idx = cmd - '1';
+        RtdbPointId id = RTDB_POINT_LED1 + led_idx;
+        led_toggle_cycles = k_cycle_get_32();
+        atomic_set(&led_toggle_pending, 1);
+        int64_t now_us = rtdb_now_us();
+        k_spinlock_key_t key = rtdb_write_begin(RTDB_SITE_LED_TOGGLE);
+        uint32_t changed = rtdb_store(id, !rtdb.data.points[id], now_us); // Toggle LED state in the database
+        rtdb_write_end(key, changed);
+        snprintf(output, size, "Toggle LED %d \r\n", led_idx + 1);
+    } else if (cmd >= '5' && cmd <= '8') {
+        int button_idx = cmd - '5';
+        int64_t timestamp_us;
+        int state = rtdb_get_timed(RTDB_POINT_BUTTON1 + button_idx, &timestamp_us);
+        snprintf(output, size, "Button %d state: %d age: %u us\r\n", button_idx + 1, state,
+                 rtdb_sample_age_us(timestamp_us));
+    } else if (cmd == '9') {
+        int64_t timestamp_us;
+        int raw_value = rtdb_get_timed(RTDB_POINT_AN_RAW, &timestamp_us);
+        snprintf(output, size, "Raw sensor value: %d age: %u us\r\n", raw_value,
+                 rtdb_sample_age_us(timestamp_us));
+    } else if (cmd == '0') {
+        int64_t timestamp_us;
+        int processed_value = rtdb_get_timed(RTDB_POINT_AN_VAL, &timestamp_us);
+        snprintf(output, size, "Processed sensor value: %d  Celsius age: %u us\r\n",
+                 processed_value, rtdb_sample_age_us(timestamp_us));
+    } else if (cmd == 'l') {
+        snprintf(output, size, "LED latency last: %u us max: %u us\r\n",
+                 led_latency_last_us, led_latency_max_us);
+    } else if (cmd == 'h') {
+        RtdbSample samples[4];
+        size_t count = rtdb_history_since(rtdb_now_us() - 10 * USEC_PER_SEC,
+                                          samples, ARRAY_SIZE(samples));
+        size_t len = snprintf(output, size, "History (%u):", (unsigned)count);
+        for (size_t j = 0; j < count && len < size; j++) {
+            len += snprintf(output + len, size - len, " [%lld us %d %d]",
+                            (long long)samples[j].timestamp_us, samples[j].raw, samples[j].value);
+        }
+        snprintf(output + MIN(len, size - 3), 3, "\r\n");
+    } else if (cmd == 't') {
+        SensorStats stats;
+        sensor_stats_snapshot(&stats);
+        snprintf(output, size,
+                 "Stats n=%u min=%d max=%d mean=%d sd=%d ewma=%d p50=%d p95=%d p99=%d\r\n",
+                 stats.count, stats.min, stats.max,
+                 (int)(stats.mean >> STATS_MEAN_FRAC_BITS), sensor_stats_stddev(&stats),
+                 (int)(stats.ewma >> STATS_FRAC_BITS), sensor_stats_percentile(&stats, 50),
+                 sensor_stats_percentile(&stats, 95), sensor_stats_percentile(&stats, 99));
+    } else if (cmd == 'b') {
+        static uint32_t last_samples;
+        static int64_t last_time;
+        static k_thread_runtime_stats_t last_cpu;
+        k_thread_runtime_stats_t cpu;
+        uint32_t samples = atomic_get(&pipeline_samples);
+        int64_t now = k_uptime_get();
+        uint32_t rate = now > last_time ?
+                        (uint64_t)(samples - last_samples) * MSEC_PER_SEC / (now - last_time) : 0;
+        // CPU load since the last 'b', and the rate at which it would reach 100 %
+        k_thread_runtime_stats_all_get(&cpu);
+        uint64_t elapsed = cpu.execution_cycles - last_cpu.execution_cycles;
+        uint64_t busy = elapsed - (cpu.idle_cycles - last_cpu.idle_cycles);
+        uint32_t load = elapsed ? busy * 10000 / elapsed : 0;  // In 0.01 %
+        uint32_t max_rate = load ? (uint64_t)rate * 10000 / load : 0;
+        last_samples = samples;
+        last_time = now;
+        last_cpu = cpu;
+        size_t len = snprintf(output, size,
+                              "Pipeline: %u samples %u blocks %u gaps %u overruns, %u samples/s\r\n"
+                              "Buffers: %u/%u used high-water %u exhausted %u\r\n",
+                              samples, (unsigned)atomic_get(&pipeline_blocks),
+                              (unsigned)atomic_get(&pipeline_gaps), (unsigned)atomic_get(&adc_overruns),
+                              rate, k_mem_slab_num_used_get(&sample_slab), SAMPLE_BUFFER_COUNT,
+                              (unsigned)atomic_get(&sample_pool_high_water),
+                              (unsigned)atomic_get(&sample_pool_exhausted));
+        for (size_t q = 0; q < ARRAY_SIZE(pipeline_queues) && len < size; q++) {
+            len += pipeline_queue_format(output + len, size - len, pipeline_queues[q]);
+        }
+        if (len < size) {
+            snprintf(output + len, size - len,
+                     "CPU (%s): load %u.%02u%% est. max %u samples/s\r\n",
+                     PIPELINE_FUSED ? "fused" : "threaded", load / 100, load % 100, max_rate);
+        }
+    } else if (cmd == 'n') {
+        adc_mode_stats_format(output, size);
+    } else if (cmd == 'i') {
+        stage_latency_format(output, size);
+    } else if (cmd == 'q') {
+        uint32_t taken = atomic_get(&adaptive_samples);
+        uint32_t at_max = atomic_get(&adaptive_samples_at_max);
+        snprintf(output, size,
+                 "Adaptive: %u Hz (%u..%u) steps up %u down %u, %u samples vs %u at max (%u%%)\r\n",
+                 (unsigned)atomic_get(&adc_rate_hz), (unsigned)atomic_get(&adc_base_rate_hz),
+                 (unsigned)atomic_get(&adaptive_max_hz), (unsigned)atomic_get(&adaptive_steps_up),
+                 (unsigned)atomic_get(&adaptive_steps_down), taken, at_max,
+                 at_max ? (unsigned)((uint64_t)taken * 100 / at_max) : 0);
+    } else if (cmd == 'e') {
+        size_t len = snprintf(output, size, "Reports (change/heartbeat/suppressed):");
+        for (int channel = 0; channel < SENSOR_CHANNEL_COUNT && len < size; channel++) {
+            const ChannelReport *report = &channel_reports[channel];
+            len += snprintf(output + len, size - len, " ch%d %u/%u/%u", channel,
+                            (unsigned)atomic_get(&report->reports),
+                            (unsigned)atomic_get(&report->heartbeats),
+                            (unsigned)atomic_get(&report->suppressed));
+        }
+        snprintf(output + MIN(len, size - 3), 3, "\r\n");
+    } else if (cmd == 'a') {
+        IoModuleData snap;
+        rtdb_snapshot(&snap);
+        // Age of the stalest sensor value, the whole record is at least this old
+        int64_t oldest_us = INT64_MAX;
+        for (int channel = 0; channel < SENSOR_CHANNEL_COUNT; channel++) {
+            oldest_us = MIN(oldest_us, snap.timestamp_us[RTDB_POINT_CH_VAL(channel)]);
+        }
+        size_t len = snprintf(output, size, "age=%uus ", rtdb_sample_age_us(oldest_us));
+        for (int id = 0; id < RTDB_POINT_COUNT && len < size; id++) {
+            len += rtdb_point_format(output + len, size - len, id, snap.points[id]);
+            if (len < size) {
+                output[len++] = ' ';
+            }
+        }
+        snprintf(output + MIN(len, size - 3), 3, "\r\n");
+    } else if (cmd == 'C') {
+        RtdbAdcCal history[ADC_CAL_HISTORY_SIZE];
+        size_t count = rtdb_adc_cal_history(history);
+        size_t len = snprintf(output, size,
+                              "ADC cal: %d runs, gap %u us (max %u) for a %u us block, probe %s\r\n",
+                              rtdb_get(RTDB_POINT_ADC_CALS), (unsigned)atomic_get(&adc_cal_gap_us),
+                              (unsigned)atomic_get(&adc_cal_gap_max_us),
+                              (unsigned)atomic_get(&adc_cal_block_us),
+                              adc_offset_channel >= 0 ? "on" : "off");
+        for (size_t j = 0; j < count && len < size; j++) {
+            len += snprintf(output + len, size - len, "  %lld us: offset %d -> %d lsb\r\n",
+                            (long long)history[j].timestamp_us, history[j].before, history[j].after);
+        }
+    } else if (cmd == 'R') {
+        atomic_set(&adc_cal_request, 1);
+        atomic_set(&adc_restart, 1);  // Applied at the next block boundary
+        snprintf(output, size, "ADC recalibration requested\r\n");
+    } else {
+        return 0;  // Unknown command, or an argument out of range
+    }
+    return strlen(output);
+}
+
+/**
+ * @brief UART event callback function: parses incoming commands and hands them to uart_command_thread.
+ *
+ * Runs in interrupt context, so it only collects the command letter and its decimal argument;
+ * reading the database and formatting the reply happen in the thread.
  *
  * @param dev Pointer to the device structure for the driver instance.
  * @param evt Data structure containing event details.
  * @param user_data Additional data, unused in this callback.
  */
 void uart_callback(const struct device *dev, struct uart_event *evt, void *user_data) {
-    static char output[64]; // Buffer to store output string
+    static uint8_t arg_cmd;  // Command waiting for its decimal argument, 0 if none
+    static uint32_t arg;
+    static bool arg_negative;  // Leading '-' seen, only taken by the 'y' command
+    static uint32_t arg_scale;  // Weight of the first digit, to split off a leading channel number
+    static bool arg_overflow;  // Argument does not fit in 32 bits, the command is dropped
 
     switch (evt->type) {
         case UART_RX_RDY:
             for (int i = 0; i < evt->data.rx.len; i++) {
                 uint8_t cmd = evt->data.rx.buf[evt->data.rx.offset + i];
-
-                if (cmd >= '1' && cmd <= '4') {
-                    int led_idx = cmd - '1';
-                    k_mutex_lock(&rtdb.lock, K_FOREVER);
-                    rtdb.data.led_state[led_idx] ^= 1; // Toggle LED state in the database
-                    k_mutex_unlock(&rtdb.lock);
-                    snprintf(output, sizeof(output), "Toggle LED %d \r\n", led_idx + 1);
-                } else if (cmd >= '5' && cmd <= '8') {
-                    int button_idx = cmd - '5';
-                    k_mutex_lock(&rtdb.lock, K_FOREVER);
-                    int state = rtdb.data.button_state[button_idx];
-                    k_mutex_unlock(&rtdb.lock);
-                    snprintf(output, sizeof(output), "Button %d state: %d\r\n", button_idx + 1, state);
-                } else if (cmd == '9') {
-                    k_mutex_lock(&rtdb.lock, K_FOREVER);
-                    int raw_value = rtdb.data.an_raw;
-                    k_mutex_unlock(&rtdb.lock);
-                    snprintf(output, sizeof(output), "Raw sensor value: %d\r\n", raw_value);
-                } else if (cmd == '0') {
-                    k_mutex_lock(&rtdb.lock, K_FOREVER);
-                    int processed_value = rtdb.data.an_val;
-                    k_mutex_unlock(&rtdb.lock);
-                    snprintf(output, sizeof(output), "Processed sensor value: %d  Celsius\r\n", processed_value);
-                } else {
+                UartRequest req = { .cmd = cmd };
+
+                if (arg_cmd != 0) {
+                    // Collect the decimal argument of the pending command up to CR or LF
+                    if (cmd >= '0' && cmd <= '9') {
+                        if (arg > (UINT32_MAX - 9) / 10) {
+                            arg_overflow = true;
+                            continue;
+                        }
+                        arg_scale = arg_scale == 0 ? 1 : arg_scale * 10;
+                        arg = arg * 10 + (cmd - '0');
+                        continue;
+                    }
+                    if (cmd == '-' && arg == 0 && !arg_negative) {
+                        arg_negative = true;
+                        continue;
+                    }
+                    req = (UartRequest){ .cmd = arg_cmd, .negative = arg_negative, .arg = arg, .arg_scale = arg_scale };
+                    arg_cmd = 0;
+                    if ((cmd != '\r' && cmd != '\n') || arg_overflow || (arg_negative && req.cmd != 'y')) {
+                        continue; // Drop commands with a malformed or out-of-range argument
+                    }
+                } else if (cmd != 0 && strchr(UART_ARG_COMMANDS, cmd) != NULL) {
+                    arg_cmd = cmd;
+                    arg = 0;
+                    arg_negative = false;
+                    arg_scale = 0;
+                    arg_overflow = false;
+                    continue;
+                } else if (cmd == 0 || strchr(UART_COMMANDS, cmd) == NULL) {
                     continue; // Ignore unrecognized commands
                 }
 
-                uart_tx(dev, output, strlen(output), SYS_FOREVER_MS);
+                if (k_msgq_put(&uart_requests, &req, K_NO_WAIT) != 0) {
+                    atomic_inc(&uart_requests_dropped);
+                }
             }
             break;
         case UART_RX_DISABLED:
             uart_rx_enable(dev, rx_buf, sizeof(rx_buf), RECEIVE_TIMEOUT);
             break;
+        case UART_TX_DONE:
+        case UART_TX_ABORTED:
+            k_sem_give(&uart_tx_idle);
+            break;
         default:
             break;
     }
 }
 
+/**
+ * @brief Thread function answering the UART commands queued by uart_callback(), one at a time.
+ *
+ * The reply is transmitted by DMA straight from the output buffer, so the thread waits for the
+ * previous transmission to end before formatting the next one. Commands that arrived while the
+ * queue was full are reported at the head of the next reply.
+ *
+ * @param p1 Unused parameter.
+ * @param p2 Unused parameter.
+ * @param p3 Unused parameter.
+ */
+void uart_command_thread(void *p1, void *p2, void *p3) {
+    static char output[1024]; // Buffer to store output string, large enough for every point with 'a'
+    UartRequest req;
+
+    while (1) {
+        k_msgq_get(&uart_requests, &req, K_FOREVER);
+        k_sem_take(&uart_tx_idle, K_FOREVER);
+
+        size_t len = 0;
+        atomic_val_t dropped = atomic_clear(&uart_requests_dropped);
+        if (dropped != 0) {
+            len = snprintf(output, sizeof(output), "Busy: %u commands dropped\r\n", (unsigned)dropped);
+        }
+        len += uart_command_execute(&req, output + len, sizeof(output) - len);
+        if (len == 0 || uart_tx(uart, output, len, SYS_FOREVER_MS) != 0) {
+            k_sem_give(&uart_tx_idle);  // Nothing in flight, no UART_TX_DONE will come
+        }
+    }
+}
+
 /**
  * @brief Thread function to control LED states based on data in the shared database.
  *
- * This thread periodically checks if the LED states stored in the real-time database have changed.
- * If a change is detected, it updates the physical state of the LEDs to reflect these changes.
- * The function uses a mutex to synchronize access to the shared data, ensuring thread safety.
+ * This thread subscribes to the LED fields of the real-time database and sleeps until one of
+ * them changes. It then updates the physical state of the LEDs to reflect these changes and
+ * records the toggle-to-GPIO latency. The LED states are copied out with a lock-free sequence
+ * read, so the GPIO writes happen outside any critical section.
  *
  * @param p1 Unused parameter.
  * @param p2 Unused parameter.
  * @param p3 Unused parameter.
  *
  * @note This function is designed to run indefinitely as a thread in the system.
- *       It uses a mutex to ensure that access to shared resources is thread-safe.
+ *       It never blocks writers of the shared database.
  */
 void led_thread(void *p1, void *p2, void *p3) {
     const struct gpio_dt_spec *leds[] = {&led0, &led1, &led2, &led3};
-    uint8_t current_led_states[4] = {0};
+    int32_t current_led_states[4] = {-1, -1, -1, -1};  // Drive every LED on the first pass
+    int32_t led_states[4];
+    static RtdbSubscription sub;
+
+    rtdb_subscribe(&sub, RTDB_FIELD_LEDS);
 
     while (1) {
-        k_mutex_lock(&rtdb.lock, K_FOREVER);
+        atomic_val_t seq;
+        do {
+            seq = rtdb_read_begin();
+            memcpy(led_states, &rtdb.data.points[RTDB_POINT_LED1], sizeof(led_states));
+        } while (rtdb_read_retry(seq));
+
+        bool updated = false;
         for (int i = 0; i < 4; i++) {
-            if (rtdb.data.led_state[i] != current_led_states[i]) {
-                gpio_pin_set_dt(leds[i], rtdb.data.led_state[i]);
-                current_led_states[i] = rtdb.data.led_state[i]; // Update current state to match the database
+            if (led_states[i] != current_led_states[i]) {
+                gpio_pin_set_dt(leds[i], led_states[i]);
+                current_led_states[i] = led_states[i]; // Update current state to match the database
+                updated = true;
             }
         }
-        k_mutex_unlock(&rtdb.lock);
-        k_msleep(100);  // Sleep for some time before checking again
+        // Boot, restored states and other writers are not toggles, only time those from the UART
+        if (updated && atomic_clear(&led_toggle_pending)) {
+            led_latency_last_us = k_cyc_to_us_floor32(k_cycle_get_32() - led_toggle_cycles);
+            led_latency_max_us = MAX(led_latency_max_us, led_latency_last_us);
+        }
+        rtdb_wait_changes(&sub, K_FOREVER);  // Sleep until an LED field changes
     }
 }
 
@@ -226,107 +1483,291 @@ void led_thread(void *p1, void *p2, void *p3) {
  * @param p3 Unused parameter.
  *
  * @note This function runs indefinitely as a thread, repeatedly checking button states and
- *       updating the shared database. It employs a mutex to synchronize access to the shared
- *       data to prevent data races and ensure consistency.
+ *       updating the shared database. All GPIO reads happen outside the database lock;
+ *       the four states are then published in one short transaction.
  */
 void button_thread(void *p1, void *p2, void *p3) {
+    const struct gpio_dt_spec *buttons[] = {&button1, &button2, &button3, &button4};
+    RtdbTxn txn;
+
     while (1) {
-        k_mutex_lock(&rtdb.lock, K_FOREVER);
-        bool current_state;
+        rtdb_txn_begin(&txn);
+        for (int i = 0; i < 4; i++) {
+            // Stage button state, stored only if changed
+            rtdb_txn_set(&txn, RTDB_POINT_BUTTON1 + i, gpio_pin_get_dt(buttons[i]));
+        }
+        rtdb_txn_commit(&txn, RTDB_SITE_BUTTONS);
+        //printk("button thread\n");
+        k_msleep(100);  // 
+    }
+}
+
+static int16_t adc_sample_buffer[SENSOR_CHANNEL_COUNT];  // Conversion results of the current sampling
+static uint32_t adc_channel_mask;  // SAADC channels of the sequence
+static uint8_t adc_result_index[SENSOR_CHANNEL_COUNT];  // Position of each channel in adc_sample_buffer
+static SampleBuffer *adc_block;  // Buffer being filled, NULL while the pool is exhausted
+static SampleBuffer *adc_block_held;  // Full block the block policy kept out of queue_adc_raw
+static uint32_t adc_block_sequence;  // Sequence number of the next block
+static uint32_t adc_interval_us;  // Sample period of the running acquisition
+static uint8_t adc_block_resolution;  // Resolution of the running acquisition
+static uint8_t adc_block_oversampling;  // Oversampling of the running acquisition
+static uint16_t adc_block_len;  // Samples per block of the running acquisition
+static uint16_t adc_block_fill;  // Samples taken for the current block so far
 
-        // Check button 1 state and print if changed
-        current_state = gpio_pin_get_dt(&button1);
-        if (current_state != rtdb.data.button_state[0]) {
-            rtdb.data.button_state[0] = current_state;
-            
+/**
+ * @brief ADC callback run after every sampling of the continuous acquisition.
+ *
+ * Demultiplexes the results of all channels into the current sample buffer, one array per
+ * channel, and asks the driver to repeat
+ * the sampling, so the sequence never ends and the converter keeps running at the sequence
+ * interval. Full blocks, stamped with the time of their first sample and a sequence number,
+ * are queued on queue_adc_raw and a fresh buffer is taken from the pool. If the pool is
+ * exhausted, the samples of that block are dropped and counted as an overrun. A full queue
+ * is handled by its policy without waiting; only under the block policy the block is held and
+ * the acquisition stops until sensor_reading_thread has queued it. Otherwise acquisition
+ * only stops at a block boundary, when adc_restart is set.
+ *
+ * @param dev Pointer to the ADC device structure.
+ * @param sequence Running sequence.
+ * @param sampling_index Index of the sampling, always 0 since every sampling is repeated.
+ * @return enum adc_action ADC_ACTION_REPEAT to keep sampling, ADC_ACTION_FINISH to stop.
+ */
+static enum adc_action adc_sampling_done(const struct device *dev, const struct adc_sequence *sequence,
+                                         uint16_t sampling_index) {
+    if (adc_block != NULL) {
+        if (adc_block_fill == 0) {
+            adc_block->info.timestamp_us = rtdb_now_us();
+        }
+        for (int channel = 0; channel < SENSOR_CHANNEL_COUNT; channel++) {
+            adc_block->raw[channel][adc_block_fill] = adc_sample_buffer[adc_result_index[channel]];
         }
+    }
+    if (++adc_block_fill < adc_block_len) {
+        return ADC_ACTION_REPEAT;
+    }
 
-        // Check button 2 state and print if changed
-        current_state = gpio_pin_get_dt(&button2);
-        if (current_state != rtdb.data.button_state[1]) {
-            rtdb.data.button_state[1] = current_state;
-            
+    adc_block_fill = 0;
+    bool stall = false;
+    if (adc_block != NULL) {
+        adc_block->info.sequence = adc_block_sequence;
+        adc_block->info.period_us = adc_interval_us;
+        adc_block->info.count = adc_block_len;
+        adc_block->info.resolution = adc_block_resolution;
+        adc_block->info.oversampling = adc_block_oversampling;
+        adc_block->info.acquired = timing_counter_get();
+        int ret = pipeline_queue_put(&queue_adc_raw, adc_block, K_NO_WAIT);
+        if (ret == -EAGAIN) {
+            adc_block_held = adc_block;
+            stall = true;
         }
+#if PIPELINE_FUSED
+        if (ret == 0) {
+            k_work_submit_to_queue(&pipeline_work_q, &pipeline_work);
+        }
+#endif
+    } else {
+        atomic_inc(&adc_overruns);
+    }
+    adc_block_sequence++;
+    adc_block = sample_buffer_alloc();
+
+    if (stall || atomic_get(&adc_restart)) {
+        k_sem_give(&adc_stopped);
+        return ADC_ACTION_FINISH;
+    }
+    return ADC_ACTION_REPEAT;
+}
+
+/**
+ * @brief Converts a channel acquisition time to microseconds.
+ *
+ * @param acquisition_time ADC_ACQ_TIME() value of the channel.
+ * @return uint32_t Acquisition time in microseconds, rounded up.
+ */
+static uint32_t adc_acquisition_us(uint16_t acquisition_time) {
+    if (acquisition_time == ADC_ACQ_TIME_DEFAULT) {
+        return ADC_ACQ_TIME_DEFAULT_US;
+    }
+    uint32_t value = ADC_ACQ_TIME_VALUE(acquisition_time);
+    return ADC_ACQ_TIME_UNIT(acquisition_time) == ADC_ACQ_TIME_NANOSECONDS ?
+           DIV_ROUND_UP(value, NSEC_PER_USEC) : value;
+}
 
-        // Check button 3 state and print if changed
-        current_state = gpio_pin_get_dt(&button3);
-        if (current_state != rtdb.data.button_state[2]) {
-            rtdb.data.button_state[2] = current_state;
-            
+/**
+ * @brief Configures every analog channel and works out where its result lands in a sampling.
+ *
+ * The SAADC stores the results of a scan in increasing channel order, whatever the order of
+ * io-channels, so each channel's slot is the number of scanned channels below it.
+ *
+ * @param adc_dev Pointer to the ADC device structure.
+ * @return int Returns 0 on success, otherwise a negative error code.
+ */
+static int adc_channels_setup(const struct device *adc_dev)
+{
+    uint8_t ids[SENSOR_CHANNEL_COUNT];
+    uint32_t scan_us = 0;
+    int err = 0;
+
+#if DT_NODE_HAS_PROP(ZEPHYR_USER_NODE, io_channels)
+    for (int channel = 0; channel < SENSOR_CHANNEL_COUNT && err == 0; channel++) {
+        if (adc_channels[channel].dev != adc_dev) {
+            return -ENOTSUP;  // All channels must be scanned by the same converter
         }
+        err = adc_channel_setup_dt(&adc_channels[channel]);
+        ids[channel] = adc_channels[channel].channel_id;
+        scan_us += adc_acquisition_us(adc_channels[channel].channel_cfg.acquisition_time) + ADC_CONVERSION_US;
+    }
+#else
+    err = adc_channel_setup(adc_dev, &my_channel_cfg);
+    ids[0] = ADC_CHANNEL_ID;
+    scan_us = adc_acquisition_us(my_channel_cfg.acquisition_time) + ADC_CONVERSION_US;
+#endif
+    if (err != 0) {
+        return err;
+    }
 
-        // Check button 4 state and print if changed
-        current_state = gpio_pin_get_dt(&button4);
-        if (current_state != rtdb.data.button_state[3]) {
-            rtdb.data.button_state[3] = current_state;
-            
+    adc_scan_us = scan_us;
+    adc_channel_mask = 0;
+    for (int channel = 0; channel < SENSOR_CHANNEL_COUNT; channel++) {
+        adc_channel_mask |= BIT(ids[channel]);
+    }
+    if (POPCOUNT(adc_channel_mask) != SENSOR_CHANNEL_COUNT) {
+        return -EINVAL;  // The same input listed twice
+    }
+    for (int channel = 0; channel < SENSOR_CHANNEL_COUNT; channel++) {
+        adc_result_index[channel] = POPCOUNT(adc_channel_mask & (BIT(ids[channel]) - 1));
+    }
+
+    // Offset probe: a spare channel with both inputs on the pin of channel 0 reads 0 V plus
+    // the converter offset, with the gain and reference of channel 0
+    uint32_t spare = ~adc_channel_mask & BIT_MASK(SENSOR_CHANNEL_MAX);
+    adc_offset_channel = -1;
+    if (spare != 0) {
+#if DT_NODE_HAS_PROP(ZEPHYR_USER_NODE, io_channels)
+        struct adc_channel_cfg probe = adc_channels[0].channel_cfg;
+#else
+        struct adc_channel_cfg probe = my_channel_cfg;
+#endif
+        probe.channel_id = find_msb_set(spare) - 1;
+        probe.differential = 1;
+        probe.input_negative = probe.input_positive;
+        if (adc_channel_setup(adc_dev, &probe) == 0) {
+            adc_offset_channel = probe.channel_id;
         }
-        //printk("button thread\n");
-        k_mutex_unlock(&rtdb.lock);
-        k_msleep(100);  // 
     }
+    return 0;
 }
 
-static uint16_t adc_sample_buffer[1];  // Single sample buffer
+/**
+ * @brief Reads the converter offset on the probe channel.
+ *
+ * @param adc_dev Pointer to the ADC device structure.
+ * @param calibrate Run the SAADC offset calibration before the conversion.
+ * @param offset Receives the offset, in LSB at ADC_CAL_RESOLUTION bits.
+ * @return int Returns 0 on success, otherwise a negative error code.
+ */
+static int adc_offset_read(const struct device *adc_dev, bool calibrate, int16_t *offset) {
+    struct adc_sequence sequence = {
+        .channels     = BIT(adc_offset_channel),
+        .buffer       = offset,
+        .buffer_size  = sizeof(*offset),
+        .resolution   = ADC_CAL_RESOLUTION,
+        .oversampling = ADC_CAL_OVERSAMPLING,
+        .calibrate    = calibrate,
+    };
+    return adc_read(adc_dev, &sequence);
+}
 
+/**
+ * @brief Runs the SAADC offset calibration and records it in the RTDB.
+ *
+ * Must only be called while the continuous acquisition is stopped. The offset is measured on
+ * the probe channel before and after the calibration, so the history shows both the drift
+ * since the previous calibration and what is left after it. Without a spare channel for the
+ * probe, the calibration still runs on a throwaway scan of the sensor channels and is
+ * recorded with zero offsets.
+ *
+ * @param adc_dev Pointer to the ADC device structure.
+ * @return int Returns 0 on success, otherwise a negative error code.
+ */
+static int adc_offset_calibrate(const struct device *adc_dev) {
+    RtdbAdcCal cal = { .timestamp_us = rtdb_now_us() };
+    int err;
+
+    if (adc_offset_channel >= 0) {
+        err = adc_offset_read(adc_dev, false, &cal.before);
+        if (err == 0) {
+            err = adc_offset_read(adc_dev, true, &cal.after);
+        }
+    } else {
+        int16_t scratch[SENSOR_CHANNEL_COUNT];
+        struct adc_sequence sequence = {
+            .channels    = adc_channel_mask,
+            .buffer      = scratch,
+            .buffer_size = sizeof(scratch),
+            .resolution  = ADC_CAL_RESOLUTION,
+            .calibrate   = true,
+        };
+        err = adc_read(adc_dev, &sequence);
+    }
+    if (err == 0) {
+        rtdb_adc_cal_append(&cal);
+    }
+    return err;
+}
 
 /**
- * @brief Reads an analog value from the ADC channel specified in the configuration.
+ * @brief Starts continuous acquisition on the ADC channels specified in the configuration.
  *
- * This function configures an ADC sequence with predefined settings such as channel, buffer,
- * buffer size, and resolution. It initiates an ADC read using the configured sequence
- * and returns the result of the read operation.
+ * The sequence scans all channels every 1/adc_rate_hz seconds from the driver's interval timer, at the
+ * resolution and oversampling currently selected, and hands blocks of about ADC_BLOCK_PERIOD_MS
+ * of signal to the processing stage through queue_adc_raw.
  *
  * @param adc_dev Pointer to the ADC device structure.
- * @return int Returns 0 if the ADC read is successful, otherwise returns a negative error code.
+ * @return int Returns 0 if the acquisition started, otherwise returns a negative error code.
  *
  * @note The ADC configuration, including gain, reference voltage, and acquisition time, is set
  *       elsewhere in the program and affects the accuracy and range of the ADC read.
  */
-static int read_adc(const struct device *adc_dev)
+static int adc_start_continuous(const struct device *adc_dev)
 {
-    struct adc_sequence sequence = {
-        .channels    = BIT(ADC_CHANNEL_ID),
+    static struct adc_sequence_options options = {
+        .callback = adc_sampling_done,
+    };
+    static struct adc_sequence sequence = {
+        .options     = &options,
         .buffer      = adc_sample_buffer,
         .buffer_size = sizeof(adc_sample_buffer),
-        .resolution  = ADC_RESOLUTION,
     };
-    return adc_read(adc_dev, &sequence);
-}
-
-/*void adc_thread(void *p1, void *p2, void *p3) {
-    const struct device *adc_dev = DEVICE_DT_GET_ONE(nordic_nrf_saadc);
-    adc_channel_setup(adc_dev, &my_channel_cfg);
-
-    while (1) {
-        if (read_adc(adc_dev) == 0) {
-            k_mutex_lock(&rtdb.lock, K_FOREVER);
-            rtdb.data.an_raw = adc_sample_buffer[0];
-            // Correct calculation for voltage and temperature
-            float voltage = (rtdb.data.an_raw / 1023.0f) * 3.0f; // Scaling the raw value to voltage
-            rtdb.data.an_val = 60 * (voltage - 1); // Calculating temperature from voltage
-            k_mutex_unlock(&rtdb.lock);
-
-            char buffer[128]; // Buffer for formatted string
-            int length = snprintf(buffer, sizeof(buffer), "ADC Raw: %d, Voltage: %.2f V, Temperature: %.2f °C\n",
-                                  rtdb.data.an_raw, voltage, rtdb.data.an_val);
-
-            if (length > 0 && length < sizeof(buffer)) {
-                printk("%s", buffer);
-            } else {
-                printk("Error: Buffer overflow or snprintf failed\n");
-            }
-        }
-        k_msleep(1000);
+    uint32_t rate = atomic_get(&adc_rate_hz);
+
+    // Resolution and oversampling only change here, between two runs of the acquisition
+    adc_block_resolution = atomic_get(&adc_resolution);
+    adc_block_oversampling = atomic_get(&adc_oversampling);
+    sequence.channels = adc_channel_mask;
+    sequence.resolution = adc_block_resolution;
+    sequence.oversampling = adc_block_oversampling;
+
+    // Blocks carry the period the driver really runs at, see adc_sample_period_us()
+    options.interval_us = USEC_PER_SEC / rate;
+    adc_interval_us = adc_sample_period_us(rate, adc_block_oversampling);
+    adc_block_len = CLAMP(ADC_BLOCK_PERIOD_MS * USEC_PER_MSEC / adc_interval_us, 1, ADC_BLOCK_MAX);
+    adc_block_fill = 0;
+    if (adc_block == NULL) {
+        adc_block = sample_buffer_alloc();
     }
-}*/
+    k_poll_signal_reset(&adc_done);
+    return adc_read_async(adc_dev, &sequence, &adc_done);
+}
 
  /**
  * @brief Thread function to continuously read sensor data using ADC.
  *
- * This thread initializes the ADC device and continuously reads the ADC values,
- * posting the raw sensor data to a message queue. This function aims to sample sensor data at a
- * regular interval of one second.
+ * This thread initializes and calibrates the ADC device and starts continuous acquisition; the
+ * sampling callback then passes full blocks straight to the processing stage. The thread only
+ * waits for the acquisition to stop (rate change, recalibration) or go silent, and starts it
+ * again. Recalibrations requested by adc_cal_timer run while the acquisition is stopped at a
+ * block boundary, so they delay the next block by the calibration time only.
  *
  * @param p1 Unused parameter.
  * @param p2 Unused parameter.
@@ -334,40 +1775,177 @@ static int read_adc(const struct device *adc_dev)
  */
 void sensor_reading_thread(void *p1, void *p2, void *p3) {
     const struct device *adc_dev = DEVICE_DT_GET_ONE(nordic_nrf_saadc);
-    adc_channel_setup(adc_dev, &my_channel_cfg);
+    int err = adc_channels_setup(adc_dev);
+    if (err != 0) {
+        printk("ADC channel setup failed: %d\n", err);
+        return;
+    }
+    err = adc_offset_calibrate(adc_dev);
+    if (err != 0) {
+        printk("ADC offset calibration failed: %d\n", err);
+    }
+    k_timer_start(&adc_cal_timer, K_MSEC(ADC_CAL_PERIOD_MS), K_MSEC(ADC_CAL_PERIOD_MS));
 
     while (1) {
-        int16_t raw_value;
-        if (read_adc(adc_dev) == 0) {
-            raw_value = adc_sample_buffer[0];
-            k_msgq_put(&msgq_adc_raw, &raw_value, K_FOREVER);
+        if (adc_block_held != NULL) {
+            // Block policy: the sampler waits here until the processing stage takes a block
+            pipeline_queue_put(&queue_adc_raw, adc_block_held, K_FOREVER);
+            adc_block_held = NULL;
+#if PIPELINE_FUSED
+            k_work_submit_to_queue(&pipeline_work_q, &pipeline_work);
+#endif
+        }
+        int64_t cal_start_us = 0;
+        if (atomic_clear(&adc_cal_request)) {
+            cal_start_us = rtdb_now_us();
+            adc_offset_calibrate(adc_dev);
+        }
+        // The callback may have stopped the last sequence just as the wait below gave up on it
+        // and saw it ended: drop that stale stop, or the new sequence would look stopped at once
+        k_sem_reset(&adc_stopped);
+        if (adc_start_continuous(adc_dev) != 0) {
+            k_msleep(SLEEP_TIME_MS);
+            continue;
+        }
+        uint32_t block_us = adc_block_len * adc_interval_us;
+        uint32_t last_sequence = adc_block_sequence;
+        if (cal_start_us != 0) {
+            uint32_t gap_us = rtdb_now_us() - cal_start_us;
+            atomic_set(&adc_cal_gap_us, gap_us);
+            atomic_set(&adc_cal_gap_max_us, MAX((uint32_t)atomic_get(&adc_cal_gap_max_us), gap_us));
+            atomic_set(&adc_cal_block_us, adc_block_len * adc_interval_us);
+        }
+
+        while (k_sem_take(&adc_stopped, K_USEC(2 * block_us + SLEEP_TIME_MS * USEC_PER_MSEC)) != 0) {
+            unsigned int ended;
+            int result;
+            k_poll_signal_check(&adc_done, &ended, &result);
+            if (ended) {
+                break;  // The driver ended the sequence on an error, without our callback stopping it
+            }
+            // Nothing for two block periods: ask for a stop at the next block boundary and keep
+            // waiting, the driver holds the sequence until then and cannot be restarted earlier
+            if (adc_block_sequence == last_sequence) {
+                atomic_set(&adc_restart, 1);
+            }
+            last_sequence = adc_block_sequence;
             //printk("Sensor reading\n");
         }
-        k_msleep(1000);  // Sampling every second
+        // Only now is the previous sequence over, so no stop request can be lost
+        atomic_clear(&adc_restart);
+    }
+}
+
+/**
+ * @brief Puts the filters of the processing stage in their boot configuration.
+ */
+static void process_init(void) {
+    for (int channel = 0; channel < SENSOR_CHANNEL_COUNT; channel++) {
+        filter_reset(&channel_filters[channel], FILTER_DEFAULT);
+    }
+}
+
+/**
+ * @brief Processing stage: converts and filters a block of raw ADC data in place.
+ *
+ * Each channel of the block is converted with its own calibration curve and two-point
+ * calibration, then run through the filter selected for the channel. The mean of channel 0
+ * is taken for the an_avg point and, with the spread of the block, drives the adaptive
+ * sampling rate. The filter state is kept from one block to the next.
+ *
+ * @param buf Block taken from queue_adc_raw.
+ */
+static void process_block(SampleBuffer *buf) {
+    buf->info.dequeued = timing_counter_get();
+    SensorCalibration cal[SENSOR_CHANNEL_COUNT];
+    k_spinlock_key_t key = k_spin_lock(&calibration_lock);
+    memcpy(cal, sensor_calibrations, sizeof(cal));
+    k_spin_unlock(&calibration_lock, key);
+    for (int channel = 0; channel < SENSOR_CHANNEL_COUNT; channel++) {
+        // Convert ADC values to temperature (or the unit of the channel)
+        int32_t raw_mean = convert_block(buf->raw[channel], buf->info.resolution, &sensor_conversions[channel],
+                                         &cal[channel], buf->value[channel], buf->info.count);
+        atomic_set(&calibration_raw_mean[channel], raw_mean);
+        filter_block(filter_for_channel(channel), buf->value[channel], buf->filtered[channel],
+                     buf->info.count);
     }
+    buf->info.mean = dsp_mean_q31(buf->value[0], buf->info.count);
+    adaptive_rate_update(&buf->info, buf->value[0]);
+    buf->info.processed = timing_counter_get();
 }
 
+/**
+ * @brief Database stage: stores a processed block and releases it.
+ *
+ * The latest sample of every channel is stored in a global structure inside a sequence-locked
+ * write section, so the database is written at most once per block. Channels that stay inside
+ * their deadband are skipped until their heartbeat is due. The points are stamped with the
+ * acquisition time of the stored sample, and the time the block spent in each stage is
+ * measured. Every sample of channel 0 goes into the history ring and the running statistics,
+ * then the sample buffer is released to the pool.
+ *
+ * @param buf Processed block, freed on return.
+ * @param dequeued Cycle counter when the database stage took the block.
+ */
+static void store_block(SampleBuffer *buf, timing_t dequeued) {
+    static uint32_t next_sequence;
+    int latest = buf->info.count - 1;
+    int64_t latest_us = buf->info.timestamp_us + (int64_t)latest * buf->info.period_us;
+    RtdbTxn txn;
+    rtdb_txn_begin(&txn);
+    txn.timestamp_us = latest_us;  // Points carry the acquisition time of the sample, not of the write
+    for (int channel = 0; channel < SENSOR_CHANNEL_COUNT; channel++) {
+        ChannelReport *report = &channel_reports[channel];
+        int decision = channel_report_check(report, channel, buf->filtered[channel], buf->info.count, latest_us);
+        if (decision == 0) {
+            continue;  // Steady channel, leave the database and its subscribers alone
+        }
+        void (*stage)(RtdbTxn *, RtdbPointId, int32_t) = decision == 2 ? rtdb_txn_refresh : rtdb_txn_set;
+        stage(&txn, RTDB_POINT_CH_RAW(channel), buf->raw[channel][latest]);
+        // Store the latest filtered value in the shared data
+        stage(&txn, RTDB_POINT_CH_VAL(channel), buf->filtered[channel][latest]);
+        if (channel == 0) {
+            stage(&txn, RTDB_POINT_AN_AVG, buf->info.mean);
+        }
+        channel_report_update(report, buf->filtered[channel][latest], latest_us);
+    }
+    rtdb_txn_commit(&txn, RTDB_SITE_DATABASE);
+    timing_t stored = timing_counter_get();
+    stage_latency_update(&buf->info, dequeued, stored);
+
+    for (int i = 0; i < buf->info.count; i++) {
+        int64_t timestamp_us = buf->info.timestamp_us + (int64_t)i * buf->info.period_us;
+        rtdb_history_append(timestamp_us, buf->raw[0][i], buf->value[0][i]);
+        sensor_stats_update(buf->value[0][i]);
+    }
+
+    if (buf->info.sequence != next_sequence) {
+        atomic_add(&pipeline_gaps, buf->info.sequence - next_sequence);
+    }
+    next_sequence = buf->info.sequence + 1;
+    atomic_add(&pipeline_samples, buf->info.count);
+    atomic_inc(&pipeline_blocks);
+    adc_mode_stats_update(&buf->info, buf->value[0]);
+    sample_buffer_free(buf);
+}
+
+#if !PIPELINE_FUSED
 /**
  * @brief Thread function to process raw ADC data from a message queue and convert it to meaningful values.
  *
- * This thread retrieves raw ADC data from a message queue, converts it to voltage, and calculates
- * the temperature from the voltage. It then stores the processed data in another message queue for
- * further usage.
+ * This thread retrieves blocks of raw ADC data from queue_adc_raw, runs process_block() on
+ * them and passes the same buffer on by pointer to the database stage.
  *
  * @param p1 Unused parameter.
  * @param p2 Unused parameter.
  * @param p3 Unused parameter.
  */
 void data_processing_thread(void *p1, void *p2, void *p3) {
-    int16_t raw_value;
-    SensorData data;
+    process_init();
     while (1) {
-        k_msgq_get(&msgq_adc_raw, &raw_value, K_FOREVER);
-        float voltage = (raw_value / 1023.0f) * 3.0f;  // Convert ADC value to voltage
-        //data.temperature = 60 * (voltage - 1);        // Convert voltage to temperature
-        data.temperature = (int)(60000 * (voltage - 1));  // Example for scaling
-        data.raw_value = raw_value;                   // Store raw value
-        k_msgq_put(&msgq_sensor_data, &data, K_FOREVER);
+        SampleBuffer *buf = pipeline_queue_get(&queue_adc_raw, K_FOREVER);
+        process_block(buf);
+        pipeline_queue_put(&queue_sensor_data, buf, K_FOREVER);
         //printk("Data_processing thread\n");
     }
 }
@@ -376,42 +1954,276 @@ void data_processing_thread(void *p1, void *p2, void *p3) {
 /**
  * @brief Thread function to store processed sensor data into a shared database.
  *
- * This thread retrieves processed sensor data from a message queue and stores it in a global
- * structure protected by a mutex. This ensures that the data is accessible across different parts
- * of the program in a thread-safe manner.
+ * This thread retrieves blocks of processed sensor data from queue_sensor_data and stores them
+ * with store_block(). This ensures that the data is accessible across different parts of the
+ * program in a thread-safe manner.
  *
  * @param p1 Unused parameter.
  * @param p2 Unused parameter.
  * @param p3 Unused parameter.
  */
 void database_thread(void *p1, void *p2, void *p3) {
-    SensorData data;
     while (1) {
-        k_msgq_get(&msgq_sensor_data, &data, K_FOREVER);
-        k_mutex_lock(&rtdb.lock, K_FOREVER);
-        rtdb.data.an_raw = data.raw_value;
-        rtdb.data.an_val = data.temperature;  // Store the latest temperature in the shared data
-        k_mutex_unlock(&rtdb.lock);
+        SampleBuffer *buf = pipeline_queue_get(&queue_sensor_data, K_FOREVER);
+        store_block(buf, timing_counter_get());
         //printk("database thread\n");
     }
 }
+#else
+/**
+ * @brief Work handler of the fused pipeline: processes and stores every queued block in one pass.
+ *
+ * Submitted by the ADC callback for each full block. Resubmitting while the handler runs
+ * queues it once more, so a block that arrives after the last check is still picked up.
+ *
+ * @param work Unused parameter.
+ */
+static void pipeline_work_handler(struct k_work *work) {
+    SampleBuffer *buf;
+
+    while ((buf = pipeline_queue_get(&queue_adc_raw, K_NO_WAIT)) != NULL) {
+        process_block(buf);
+        store_block(buf, buf->info.processed);
+    }
+}
+#endif
+
+#define CHECKPOINT_NVS_ID          1        // NVS entry holding the RTDB checkpoint
+#define CHECKPOINT_MAGIC           0x52544442
+#define CHECKPOINT_COALESCE_MS     2000     // Delay after a change so bursts end up in one write
+#define CHECKPOINT_MIN_INTERVAL_MS 10000    // Minimum time between two flash writes
+#define CHECKPOINT_PERIOD_MS       600000   // Periodic checkpoint even without change notifications
+#define CALIBRATION_NVS_ID         2        // NVS entry holding the two-point calibrations
+#define CALIBRATION_MAGIC          0x43414C31
+
+/**
+ * @struct RtdbCheckpoint
+ * @brief Flash image of the persistent RTDB points.
+ */
+typedef struct {
+    uint32_t magic;  ///< CHECKPOINT_MAGIC.
+    uint32_t point_count;  ///< RTDB_POINT_COUNT of the firmware that wrote the record.
+    uint32_t fields;  ///< RTDB_FIELD() mask of the points saved in @c points.
+    int32_t points[RTDB_POINT_COUNT];  ///< Point values, only the ones in @c fields are valid.
+    uint32_t crc;  ///< CRC-32 of all preceding members.
+} RtdbCheckpoint;
+
+static struct nvs_fs checkpoint_fs;
+static bool checkpoint_ready;
+
+/**
+ * @brief Mounts the NVS file system used for RTDB checkpoints on the storage partition.
+ *
+ * @return int Returns 0 on success, otherwise a negative error code.
+ */
+static int checkpoint_init(void) {
+    struct flash_pages_info info;
+    int ret;
+
+    checkpoint_fs.flash_device = FIXED_PARTITION_DEVICE(storage_partition);
+    if (!device_is_ready(checkpoint_fs.flash_device)) {
+        return -ENODEV;
+    }
+    checkpoint_fs.offset = FIXED_PARTITION_OFFSET(storage_partition);
+    ret = flash_get_page_info_by_offs(checkpoint_fs.flash_device, checkpoint_fs.offset, &info);
+    if (ret) {
+        return ret;
+    }
+    checkpoint_fs.sector_size = info.size;
+    checkpoint_fs.sector_count = FIXED_PARTITION_SIZE(storage_partition) / info.size;
+
+    ret = nvs_mount(&checkpoint_fs);
+    checkpoint_ready = (ret == 0);
+    return ret;
+}
+
+/**
+ * @brief Restores the persistent points from the last valid checkpoint, if any.
+ *
+ * Called from main() before the pipeline threads are created. Records written by a firmware
+ * with a different point table or with a bad CRC are ignored.
+ *
+ * @return int Returns 0 if points were restored, otherwise a negative error code.
+ */
+static int checkpoint_restore(void) {
+    RtdbCheckpoint record;
+
+    if (!checkpoint_ready) {
+        return -ENODEV;
+    }
+    if (nvs_read(&checkpoint_fs, CHECKPOINT_NVS_ID, &record, sizeof(record)) != sizeof(record)) {
+        return -ENOENT;
+    }
+    if (record.magic != CHECKPOINT_MAGIC || record.point_count != RTDB_POINT_COUNT ||
+        record.crc != crc32_ieee((const uint8_t *)&record, offsetof(RtdbCheckpoint, crc))) {
+        return -EINVAL;
+    }
+
+    RtdbTxn txn;
+    rtdb_txn_begin(&txn);
+    for (int id = 0; id < RTDB_POINT_COUNT; id++) {
+        if (record.fields & RTDB_FIELD_PERSIST & RTDB_FIELD(id)) {
+            rtdb_txn_set(&txn, id, record.points[id]);
+        }
+    }
+    rtdb_txn_commit(&txn, RTDB_SITE_RESTORE);
+    return 0;
+}
+
+/**
+ * @brief Writes the current persistent points to flash.
+ *
+ * NVS skips the write when the record is identical to the stored one, so calling this
+ * without a change costs no flash wear.
+ *
+ * @return int Returns 0 on success, otherwise a negative error code.
+ */
+static int checkpoint_save(void) {
+    RtdbCheckpoint record = {
+        .magic = CHECKPOINT_MAGIC,
+        .point_count = RTDB_POINT_COUNT,
+        .fields = RTDB_FIELD_PERSIST,
+    };
+    IoModuleData snap;
+
+    rtdb_snapshot(&snap);
+    for (int id = 0; id < RTDB_POINT_COUNT; id++) {
+        if (RTDB_FIELD_PERSIST & RTDB_FIELD(id)) {
+            record.points[id] = snap.points[id];
+        }
+    }
+    record.crc = crc32_ieee((const uint8_t *)&record, offsetof(RtdbCheckpoint, crc));
+
+    ssize_t ret = nvs_write(&checkpoint_fs, CHECKPOINT_NVS_ID, &record, sizeof(record));
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * @struct CalibrationRecord
+ * @brief Flash image of the per-unit two-point calibrations.
+ */
+typedef struct {
+    uint32_t magic;  ///< CALIBRATION_MAGIC.
+    uint32_t channel_count;  ///< SENSOR_CHANNEL_COUNT of the firmware that wrote the record.
+    SensorCalibration channels[SENSOR_CHANNEL_COUNT];  ///< Calibration of each channel.
+    uint32_t crc;  ///< CRC-32 of all preceding members.
+} CalibrationRecord;
+
+/**
+ * @brief Loads the two-point calibrations from flash.
+ *
+ * Called from main() before the pipeline threads are created. Without a valid record every
+ * channel keeps the identity calibration.
+ *
+ * @return int Returns 0 if the calibrations were restored, otherwise a negative error code.
+ */
+static int calibration_restore(void) {
+    CalibrationRecord record;
+
+    if (!checkpoint_ready) {
+        return -ENODEV;
+    }
+    if (nvs_read(&checkpoint_fs, CALIBRATION_NVS_ID, &record, sizeof(record)) != sizeof(record)) {
+        return -ENOENT;
+    }
+    if (record.magic != CALIBRATION_MAGIC || record.channel_count != SENSOR_CHANNEL_COUNT ||
+        record.crc != crc32_ieee((const uint8_t *)&record, offsetof(CalibrationRecord, crc))) {
+        return -EINVAL;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&calibration_lock);
+    memcpy(sensor_calibrations, record.channels, sizeof(sensor_calibrations));
+    k_spin_unlock(&calibration_lock, key);
+    return 0;
+}
+
+/**
+ * @brief Work handler writing the two-point calibrations to flash.
+ *
+ * Submitted by the UART commands that change a calibration, so the flash write runs on the
+ * system work queue instead of the UART command thread.
+ *
+ * @param work Unused parameter.
+ */
+static void calibration_save_handler(struct k_work *work) {
+    CalibrationRecord record = {
+        .magic = CALIBRATION_MAGIC,
+        .channel_count = SENSOR_CHANNEL_COUNT,
+    };
+
+    if (!checkpoint_ready) {
+        return;
+    }
+    k_spinlock_key_t key = k_spin_lock(&calibration_lock);
+    memcpy(record.channels, sensor_calibrations, sizeof(record.channels));
+    k_spin_unlock(&calibration_lock, key);
+    record.crc = crc32_ieee((const uint8_t *)&record, offsetof(CalibrationRecord, crc));
+
+    if (nvs_write(&checkpoint_fs, CALIBRATION_NVS_ID, &record, sizeof(record)) < 0) {
+        printk("Calibration save failed\n");
+    }
+}
+
+/**
+ * @brief Thread function to checkpoint persistent RTDB points to flash.
+ *
+ * This thread subscribes to the persistent points and writes them to flash once they stop
+ * changing for CHECKPOINT_COALESCE_MS, at most once every CHECKPOINT_MIN_INTERVAL_MS, so that
+ * bursts of changes cost a single flash write. It also saves every CHECKPOINT_PERIOD_MS as a
+ * safety net. Flash access stays out of the writers' path entirely.
+ *
+ * @param p1 Unused parameter.
+ * @param p2 Unused parameter.
+ * @param p3 Unused parameter.
+ */
+void checkpoint_thread(void *p1, void *p2, void *p3) {
+    static RtdbSubscription sub;
+    int64_t last_save = k_uptime_get();
 
-//K_THREAD_DEFINE(adc_tid, 1024, adc_thread, NULL, NULL, NULL, 7, 0, 0);
+    rtdb_subscribe(&sub, RTDB_FIELD_PERSIST);
+
+    while (1) {
+        if (rtdb_wait_changes(&sub, K_MSEC(CHECKPOINT_PERIOD_MS)) != 0) {
+            // Coalesce: wait until the points have been quiet for a while
+            while (rtdb_wait_changes(&sub, K_MSEC(CHECKPOINT_COALESCE_MS)) != 0) {
+            }
+            int64_t wait = last_save + CHECKPOINT_MIN_INTERVAL_MS - k_uptime_get();
+            if (wait > 0) {
+                k_msleep(wait);
+            }
+        }
+
+        int ret = checkpoint_save();
+        if (ret) {
+            printk("RTDB checkpoint failed (%d)\n", ret);
+        }
+        last_save = k_uptime_get();
+    }
+}
 
 /**
  * @brief Main function of the Zephyr application.
  *
  * This function performs the initial setup of the application. It configures buttons and LEDs,
- * initializes mutexes, checks device readiness, sets up UART communication, and creates
+ * clears the real-time database, checks device readiness, sets up UART communication, and creates
  * necessary threads for UART handling, sensor data reading, data processing, and database updates.
  *
  * @return int Returns 0 on success, and non-zero on error.
  */
 int main(void) {
+    timing_init();  // Cycle counter used by the lock statistics and the stage latencies
+    timing_start();
     configure_buttons_and_leds();
-    k_mutex_init(&rtdb.lock);
     memset(&rtdb.data, 0, sizeof(rtdb.data));  // Initialize all states to off
 
+    // Warm start: bring back the persistent points before any thread touches the database
+    if (checkpoint_init() == 0) {
+        checkpoint_restore();
+        calibration_restore();
+    } else {
+        printk("RTDB checkpoint storage not available\n");
+    }
+
     if (!device_is_ready(uart)) {
         printk("UART device not ready\n");
         return 1;
@@ -428,6 +2240,7 @@ int main(void) {
         return 1;
     }
 
+    k_sem_take(&uart_tx_idle, K_NO_WAIT);  // Released by UART_TX_DONE, before the first reply
     ret = uart_tx(uart, tx_buf, sizeof(tx_buf), SYS_FOREVER_MS);
     if (ret) {
         printk("UART transmission failed\n");
@@ -440,16 +2253,21 @@ int main(void) {
     }
 
     k_thread_create(&uart_thread_data, uart_stack, K_THREAD_STACK_SIZEOF(uart_stack),
-                    uart_callback, NULL, NULL, NULL, 6, 0, K_NO_WAIT);
+                    uart_command_thread, NULL, NULL, NULL, 6, 0, K_NO_WAIT);
 
-    //k_thread_create(&adc_thread_data, adc_stack, K_THREAD_STACK_SIZEOF(adc_stack),
-                    //adc_thread, NULL, NULL, NULL, 6, 0, K_NO_WAIT);                
-    
     // Create threads for sensor reading, data processing, and database
    // Thread creation
-    k_thread_create(&sensor_thread_data, sensor_stack, K_THREAD_STACK_SIZEOF(sensor_stack), sensor_reading_thread, NULL, NULL, NULL, 7, 0, K_NO_WAIT);
+#if PIPELINE_FUSED
+    process_init();
+    k_work_queue_start(&pipeline_work_q, pipeline_work_stack, K_THREAD_STACK_SIZEOF(pipeline_work_stack), 5, NULL);
+#else
     k_thread_create(&process_thread_data, process_stack, K_THREAD_STACK_SIZEOF(process_stack), data_processing_thread, NULL, NULL, NULL, 6, 0, K_NO_WAIT);
     k_thread_create(&database_thread_data, database_stack, K_THREAD_STACK_SIZEOF(database_stack), database_thread, NULL, NULL, NULL, 5, 0, K_NO_WAIT);
+#endif
+    k_thread_create(&sensor_thread_data, sensor_stack, K_THREAD_STACK_SIZEOF(sensor_stack), sensor_reading_thread, NULL, NULL, NULL, 7, 0, K_NO_WAIT);
+    if (checkpoint_ready) {
+        k_thread_create(&checkpoint_thread_data, checkpoint_stack, K_THREAD_STACK_SIZEOF(checkpoint_stack), checkpoint_thread, NULL, NULL, NULL, 8, 0, K_NO_WAIT);
+    }
     
         k_msleep(SLEEP_TIME_MS);
     }
@@ -0,0 +1,245 @@
+/**
+ * @file pipeline.h
+ * @brief Sample buffers and the bounded queues passing them by pointer between pipeline stages.
+ *
+ * Shared by the application and the pipeline benchmark, so both move blocks through the same
+ * slab and queues. The sizes default to a single channel; the application sets them from its
+ * configuration before including the header. Everything is static: the header is included by
+ * a single translation unit of each image.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <errno.h>
+#include <stdio.h>
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/timing/timing.h>
+
+#ifndef SENSOR_CHANNEL_COUNT
+#define SENSOR_CHANNEL_COUNT   1       // Channels sampled into each buffer
+#endif
+#ifndef ADC_BLOCK_MAX
+#define ADC_BLOCK_MAX          256     // Largest acquisition block, in samples
+#endif
+#ifndef SAMPLE_BUFFER_COUNT
+#define SAMPLE_BUFFER_COUNT    6       // Sample buffers shared by all pipeline stages
+#endif
+
+/**
+ * @struct BlockInfo
+ * @brief Metadata travelling with every block of samples through the pipeline.
+ */
+typedef struct {
+    uint32_t sequence;  ///< Block number, consecutive unless blocks were dropped.
+    uint32_t period_us;  ///< Time between two samples of the block, as paced by the driver (see adc_rate_ticks()).
+    int64_t timestamp_us;  ///< Uptime in microseconds of the first sample.
+    uint16_t count;  ///< Number of valid samples.
+    uint8_t resolution;  ///< ADC resolution in bits.
+    uint8_t oversampling;  ///< log2 of the conversions averaged into each sample.
+    int32_t mean;  ///< Mean value of channel 0 over the block, set by the processing stage.
+    timing_t acquired;  ///< Cycle counter when the sampler completed the block.
+    timing_t dequeued;  ///< Cycle counter when the processing stage took the block.
+    timing_t processed;  ///< Cycle counter when the processing stage passed the block on.
+} BlockInfo;
+
+/**
+ * @struct SampleBuffer
+ * @brief Block of samples passed by pointer between pipeline stages.
+ *
+ * A buffer has a single owner at a time: the sampler fills @c raw and queues it, the processing
+ * and filter stages fill @c value and @c filtered in place and pass it on, and the database stage
+ * returns it to sample_slab. Each quantity of each
+ * channel is stored as its own array so the block kernels work on contiguous samples.
+ */
+typedef struct {
+    void *fifo_reserved;  ///< Used by k_fifo, must be the first member.
+    BlockInfo info;  ///< Metadata of the block.
+    int16_t raw[SENSOR_CHANNEL_COUNT][ADC_BLOCK_MAX];  ///< Raw ADC samples.
+    int32_t value[SENSOR_CHANNEL_COUNT][ADC_BLOCK_MAX];  ///< Converted values, in milli-units.
+    int32_t filtered[SENSOR_CHANNEL_COUNT][ADC_BLOCK_MAX];  ///< Values after the channel filter.
+} SampleBuffer;
+
+K_MEM_SLAB_DEFINE_STATIC(sample_slab, sizeof(SampleBuffer), SAMPLE_BUFFER_COUNT, 8);
+static atomic_t sample_pool_exhausted;  // Allocations that found the pool empty
+static atomic_t sample_pool_high_water;  // Most buffers in use at the same time
+
+/**
+ * @brief Takes a sample buffer from the pool. Safe in interrupt context.
+ *
+ * @return SampleBuffer* The buffer, or NULL if the pool is exhausted.
+ */
+static inline SampleBuffer *sample_buffer_alloc(void) {
+    SampleBuffer *buf;
+
+    if (k_mem_slab_alloc(&sample_slab, (void **)&buf, K_NO_WAIT) != 0) {
+        atomic_inc(&sample_pool_exhausted);
+        return NULL;
+    }
+    atomic_val_t used = k_mem_slab_num_used_get(&sample_slab);
+    atomic_val_t high = atomic_get(&sample_pool_high_water);
+    while (used > high && !atomic_cas(&sample_pool_high_water, high, used)) {
+        high = atomic_get(&sample_pool_high_water);
+    }
+    return buf;
+}
+
+/**
+ * @brief Returns a sample buffer to the pool.
+ *
+ * @param buf Buffer to release, owned by the caller.
+ */
+static inline void sample_buffer_free(SampleBuffer *buf) {
+    k_mem_slab_free(&sample_slab, buf);
+}
+
+/**
+ * @brief What a pipeline queue does with a block put while it is full.
+ */
+typedef enum {
+    QUEUE_BLOCK,        ///< The producer waits for the consumer to take a block.
+    QUEUE_DROP_NEWEST,  ///< The new block is dropped.
+    QUEUE_DROP_OLDEST,  ///< The oldest queued block is dropped to make room.
+    QUEUE_COALESCE,     ///< Every queued block is dropped, the consumer only gets the latest.
+    QUEUE_POLICY_COUNT
+} QueuePolicy;
+
+static const char *const queue_policy_names[QUEUE_POLICY_COUNT] = {
+    "block", "drop-newest", "drop-oldest", "coalesce",
+};
+
+/**
+ * @struct PipelineQueue
+ * @brief Bounded FIFO of sample buffers between two pipeline stages, with an overflow policy.
+ */
+typedef struct {
+    struct k_fifo *fifo;  ///< Queued buffers.
+    struct k_sem *freed;  ///< Given when the consumer takes a buffer, wakes a blocked producer.
+    struct k_spinlock lock;  ///< Serialises producers, so depth checks and drops are atomic.
+    const char *name;  ///< Name shown by the UART statistics.
+    uint16_t capacity;  ///< Most buffers queued at once.
+    atomic_t policy;  ///< QueuePolicy applied when full, can be changed at run time.
+    atomic_t depth;  ///< Buffers currently queued.
+    atomic_t high_water;  ///< Largest depth seen.
+    atomic_t dropped;  ///< Buffers dropped by the policy.
+    atomic_t blocked;  ///< Puts that had to wait for room.
+} PipelineQueue;
+
+#define PIPELINE_QUEUE_DEFINE(_name, _capacity, _policy)                    \
+    K_FIFO_DEFINE(_name##_fifo);                                            \
+    K_SEM_DEFINE(_name##_freed, 0, 1);                                      \
+    static PipelineQueue _name = {                                          \
+        .fifo = &_name##_fifo,                                              \
+        .freed = &_name##_freed,                                            \
+        .name = #_name,                                                     \
+        .capacity = (_capacity),                                            \
+        .policy = ATOMIC_INIT(_policy),                                     \
+    }
+
+/**
+ * @brief Drops every queued buffer. Called with the queue lock held.
+ *
+ * @param queue Queue to flush.
+ * @param keep Buffers to leave in the queue.
+ */
+static inline void pipeline_queue_drop(PipelineQueue *queue, int keep) {
+    while (atomic_get(&queue->depth) > keep) {
+        SampleBuffer *old = k_fifo_get(queue->fifo, K_NO_WAIT);
+        if (old == NULL) {
+            break;  // The consumer took it meanwhile
+        }
+        atomic_dec(&queue->depth);
+        atomic_inc(&queue->dropped);
+        sample_buffer_free(old);
+    }
+}
+
+/**
+ * @brief Hands a buffer to the next stage, applying the overflow policy of the queue when it is full.
+ *
+ * Ownership of the buffer moves to the queue, or the buffer is freed if the policy drops it. Only the
+ * block policy ever waits, and only up to @p timeout, so K_NO_WAIT is safe in interrupt context.
+ *
+ * @param queue Destination queue.
+ * @param buf Buffer to queue.
+ * @param timeout Longest wait for room under the block policy.
+ * @return int 0 if queued, -ENOBUFS if @p buf was dropped, -EAGAIN if it is still owned by the
+ *             caller because the queue stayed full under the block policy.
+ */
+static inline int pipeline_queue_put(PipelineQueue *queue, SampleBuffer *buf, k_timeout_t timeout) {
+    bool waited = false;
+
+    while (1) {
+        k_spinlock_key_t key = k_spin_lock(&queue->lock);
+        if (atomic_get(&queue->depth) >= queue->capacity) {
+            switch (atomic_get(&queue->policy)) {
+                case QUEUE_DROP_NEWEST:
+                    k_spin_unlock(&queue->lock, key);
+                    atomic_inc(&queue->dropped);
+                    sample_buffer_free(buf);
+                    return -ENOBUFS;
+                case QUEUE_DROP_OLDEST:
+                    pipeline_queue_drop(queue, queue->capacity - 1);
+                    break;
+                case QUEUE_COALESCE:
+                    pipeline_queue_drop(queue, 0);
+                    break;
+                default:
+                    k_spin_unlock(&queue->lock, key);
+                    if (!waited) {
+                        waited = true;
+                        atomic_inc(&queue->blocked);
+                    }
+                    if (k_sem_take(queue->freed, timeout) != 0) {
+                        return -EAGAIN;
+                    }
+                    continue;
+            }
+        }
+
+        k_fifo_put(queue->fifo, buf);
+        atomic_val_t depth = atomic_inc(&queue->depth) + 1;
+        if (depth > atomic_get(&queue->high_water)) {
+            atomic_set(&queue->high_water, depth);
+        }
+        k_spin_unlock(&queue->lock, key);
+        return 0;
+    }
+}
+
+/**
+ * @brief Takes the oldest buffer of a queue, waking a producer blocked on it.
+ *
+ * @param queue Source queue.
+ * @param timeout Longest wait for a buffer.
+ * @return SampleBuffer* The buffer, now owned by the caller, or NULL on timeout.
+ */
+static inline SampleBuffer *pipeline_queue_get(PipelineQueue *queue, k_timeout_t timeout) {
+    SampleBuffer *buf = k_fifo_get(queue->fifo, timeout);
+
+    if (buf != NULL) {
+        atomic_dec(&queue->depth);
+        k_sem_give(queue->freed);
+    }
+    return buf;
+}
+
+/**
+ * @brief Formats the depth, policy and counters of a queue on one line.
+ *
+ * @param buf Output buffer.
+ * @param size Size of @p buf.
+ * @param queue Queue to describe.
+ * @return int Number of characters written, as returned by snprintf.
+ */
+static inline int pipeline_queue_format(char *buf, size_t size, PipelineQueue *queue) {
+    return snprintf(buf, size, "Queue %s (%s): %u/%u high-water %u dropped %u blocked %u\r\n",
+                    queue->name, queue_policy_names[atomic_get(&queue->policy)],
+                    (unsigned)atomic_get(&queue->depth), queue->capacity,
+                    (unsigned)atomic_get(&queue->high_water), (unsigned)atomic_get(&queue->dropped),
+                    (unsigned)atomic_get(&queue->blocked));
+}
+
+#endif /* PIPELINE_H_ */
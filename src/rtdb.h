@@ -0,0 +1,771 @@
+/**
+ * @file rtdb.h
+ * @brief Real-time database: the point table, its sequence-locked storage and the access API.
+ *
+ * Shared by the application and the RTDB tests, so both run the same write sections, stores
+ * and lock-free reads. Everything is static: the header is included by a single translation
+ * unit of each image.
+ */
+
+#ifndef RTDB_H_
+#define RTDB_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/barrier.h>
+#include <zephyr/sys/util.h>
+#include "seqlock.h"
+
+#ifndef RTDB_LOCK_STATS
+#define RTDB_LOCK_STATS        1   // Set to 0 to compile out the rtdb.lock instrumentation
+#endif
+#if RTDB_LOCK_STATS
+#include <zephyr/timing/timing.h>
+#endif
+
+#define ADC_CAL_HISTORY_SIZE   8   // Calibrations kept in the RTDB for diagnostics
+
+/**
+ * @brief Table of the points held in the real-time database.
+ *
+ * Each entry is X(id, type, name, unit, scale, persist). Adding a point here makes it available
+ * to rtdb_get()/rtdb_store(), the change notifications and the generic UART queries. Points
+ * with @c persist set are checkpointed to flash and restored on boot. Points of
+ * the same kind must stay contiguous so they can be addressed by offset, and there can be at
+ * most 32 points since change masks are 32 bits wide.
+ */
+#define RTDB_POINT_TABLE(X)                                          \
+    X(LED1,    RTDB_TYPE_BOOL,  "led1",    "",     1,    1)          \
+    X(LED2,    RTDB_TYPE_BOOL,  "led2",    "",     1,    1)          \
+    X(LED3,    RTDB_TYPE_BOOL,  "led3",    "",     1,    1)          \
+    X(LED4,    RTDB_TYPE_BOOL,  "led4",    "",     1,    1)          \
+    X(BUTTON1, RTDB_TYPE_BOOL,  "button1", "",     1,    0)          \
+    X(BUTTON2, RTDB_TYPE_BOOL,  "button2", "",     1,    0)          \
+    X(BUTTON3, RTDB_TYPE_BOOL,  "button3", "",     1,    0)          \
+    X(BUTTON4, RTDB_TYPE_BOOL,  "button4", "",     1,    0)          \
+    X(AN_RAW,  RTDB_TYPE_INT16, "an_raw",  "lsb",  1,    0)          \
+    X(AN_VAL,  RTDB_TYPE_FIXED, "an_val",  "degC", 1000, 0)          \
+    X(AN1_RAW, RTDB_TYPE_INT16, "an1_raw", "lsb",  1,    0)          \
+    X(AN1_VAL, RTDB_TYPE_FIXED, "an1_val", "degC", 1000, 0)          \
+    X(AN2_RAW, RTDB_TYPE_INT16, "an2_raw", "lsb",  1,    0)          \
+    X(AN2_VAL, RTDB_TYPE_FIXED, "an2_val", "degC", 1000, 0)          \
+    X(AN3_RAW, RTDB_TYPE_INT16, "an3_raw", "lsb",  1,    0)          \
+    X(AN3_VAL, RTDB_TYPE_FIXED, "an3_val", "degC", 1000, 0)          \
+    X(AN4_RAW, RTDB_TYPE_INT16, "an4_raw", "lsb",  1,    0)          \
+    X(AN4_VAL, RTDB_TYPE_FIXED, "an4_val", "degC", 1000, 0)          \
+    X(AN5_RAW, RTDB_TYPE_INT16, "an5_raw", "lsb",  1,    0)          \
+    X(AN5_VAL, RTDB_TYPE_FIXED, "an5_val", "degC", 1000, 0)          \
+    X(AN6_RAW, RTDB_TYPE_INT16, "an6_raw", "lsb",  1,    0)          \
+    X(AN6_VAL, RTDB_TYPE_FIXED, "an6_val", "degC", 1000, 0)          \
+    X(AN7_RAW, RTDB_TYPE_INT16, "an7_raw", "lsb",  1,    0)          \
+    X(AN7_VAL, RTDB_TYPE_FIXED, "an7_val", "degC", 1000, 0)          \
+    X(AN_AVG,  RTDB_TYPE_FIXED, "an_avg",  "degC", 1000, 0)          \
+    X(ADC_OFFSET, RTDB_TYPE_INT16, "adc_offset", "lsb", 1,  0)       \
+    X(ADC_RESIDUAL, RTDB_TYPE_INT16, "adc_residual", "lsb", 1, 0)    \
+    X(ADC_CALS, RTDB_TYPE_INT32, "adc_cals", "",    1,    0)
+
+/**
+ * @brief Storage type of a real-time database point. All points are held as int32_t.
+ */
+typedef enum {
+    RTDB_TYPE_BOOL,   ///< 0 or 1.
+    RTDB_TYPE_INT16,  ///< Clamped to the int16_t range.
+    RTDB_TYPE_INT32,  ///< Plain 32-bit integer.
+    RTDB_TYPE_FIXED,  ///< Fixed point, engineering value = stored value / scale.
+} RtdbPointType;
+
+/**
+ * @brief Index of every point in the real-time database, generated from RTDB_POINT_TABLE.
+ */
+typedef enum {
+#define RTDB_POINT_ID(id, type, name, unit, scale, persist) RTDB_POINT_##id,
+    RTDB_POINT_TABLE(RTDB_POINT_ID)
+#undef RTDB_POINT_ID
+    RTDB_POINT_COUNT
+} RtdbPointId;
+
+BUILD_ASSERT(RTDB_POINT_COUNT <= 32, "Change masks only hold 32 points");
+
+/**
+ * @struct RtdbPointMeta
+ * @brief Static description of a real-time database point.
+ */
+typedef struct {
+    const char *name;  ///< Short name used in UART responses.
+    const char *unit;  ///< Engineering unit of the scaled value.
+    RtdbPointType type;  ///< Storage type.
+    int32_t scale;  ///< Divisor from stored value to engineering value, a power of ten.
+} RtdbPointMeta;
+
+static const RtdbPointMeta rtdb_points[RTDB_POINT_COUNT] = {
+#define RTDB_POINT_META(id, type, name, unit, scale, persist) [RTDB_POINT_##id] = {name, unit, type, scale},
+    RTDB_POINT_TABLE(RTDB_POINT_META)
+#undef RTDB_POINT_META
+};
+
+/**
+ * @struct IoModuleData
+ * @brief Holds all input/output module data including state of LEDs, buttons and ADC values.
+ */
+typedef struct {
+    int32_t points[RTDB_POINT_COUNT];  ///< Point values indexed by RtdbPointId.
+    int64_t timestamp_us[RTDB_POINT_COUNT];  ///< Uptime in microseconds at which each value was acquired.
+} IoModuleData;
+
+#define RTDB_HISTORY_SIZE 64  // Number of samples kept in the history ring, power of two
+
+/**
+ * @struct RtdbSample
+ * @brief One entry of the analog sample history.
+ */
+typedef struct {
+    int64_t timestamp_us;  ///< Uptime in microseconds at which the sample was acquired.
+    int16_t raw;  ///< Raw analog sensor value.
+    int value;  ///< Processed analog sensor value.
+} RtdbSample;
+
+/**
+ * @struct RtdbHistory
+ * @brief Fixed-capacity ring of the most recent analog samples.
+ *
+ * There is a single writer (database_thread). @c head counts every sample ever appended and
+ * is only advanced once the slot has been filled, so readers can copy without a lock and
+ * discard any slot the writer may have reused while they were copying.
+ */
+typedef struct {
+    RtdbSample samples[RTDB_HISTORY_SIZE];  ///< Ring storage, indexed by head modulo size.
+    atomic_t head;  ///< Total number of samples appended.
+} RtdbHistory;
+
+BUILD_ASSERT(IS_POWER_OF_TWO(RTDB_HISTORY_SIZE), "RTDB_HISTORY_SIZE must be a power of two");
+
+/**
+ * @struct RtdbAdcCal
+ * @brief One SAADC offset calibration, in LSB at ADC_CAL_RESOLUTION bits.
+ */
+typedef struct {
+    int64_t timestamp_us;  ///< Uptime at which the calibration ran.
+    int16_t before;  ///< Offset measured just before the calibration.
+    int16_t after;  ///< Residual offset measured right after it.
+} RtdbAdcCal;
+
+/**
+ * @struct RealTimeDatabase
+ * @brief Struct to hold real-time data and the sequence lock guarding it.
+ *
+ * Writers serialise on @c lock and bump @c seq around every store, so the counter is odd
+ * while a write is in progress. Readers never take the lock: they sample @c seq, copy what
+ * they need and retry if the counter moved in the meantime.
+ */
+typedef struct {
+    IoModuleData data;  ///< Embedded structure to hold module data.
+    struct k_spinlock lock;  ///< Spinlock serialising writers, held only for the store itself.
+    atomic_t seq;  ///< Sequence counter, odd while a write is in progress.
+    uint32_t version;  ///< Database version, incremented by every write that changes a point.
+    uint32_t generation[RTDB_POINT_COUNT];  ///< Version at which each point last changed.
+    RtdbHistory history;  ///< Timestamped history of the analog channel.
+    RtdbAdcCal adc_cal[ADC_CAL_HISTORY_SIZE];  ///< Latest offset calibrations, indexed by adc_cals modulo size.
+} RealTimeDatabase;
+
+static RealTimeDatabase rtdb;
+
+// Field masks used to flag and subscribe to changes in the real-time database
+#define RTDB_FIELD(id)         BIT(id)
+#define RTDB_FIELD_LED(i)      RTDB_FIELD(RTDB_POINT_LED1 + (i))     ///< i = 0..3
+#define RTDB_FIELD_BUTTON(i)   RTDB_FIELD(RTDB_POINT_BUTTON1 + (i))  ///< i = 0..3
+#define RTDB_FIELD_AN_RAW      RTDB_FIELD(RTDB_POINT_AN_RAW)
+#define RTDB_FIELD_AN_VAL      RTDB_FIELD(RTDB_POINT_AN_VAL)
+#define RTDB_FIELD_AN_AVG      RTDB_FIELD(RTDB_POINT_AN_AVG)
+
+// Points of analog channel c, 0 being AN_RAW/AN_VAL
+#define RTDB_POINT_CH_RAW(c)   (RTDB_POINT_AN_RAW + 2 * (c))
+#define RTDB_POINT_CH_VAL(c)   (RTDB_POINT_AN_VAL + 2 * (c))
+#define RTDB_FIELD_LEDS        (RTDB_FIELD_LED(0) | RTDB_FIELD_LED(1) | RTDB_FIELD_LED(2) | RTDB_FIELD_LED(3))
+#define RTDB_FIELD_BUTTONS     (RTDB_FIELD_BUTTON(0) | RTDB_FIELD_BUTTON(1) | RTDB_FIELD_BUTTON(2) | RTDB_FIELD_BUTTON(3))
+
+// Mask of the points flagged as persistent in RTDB_POINT_TABLE
+#define RTDB_POINT_PERSIST(id, type, name, unit, scale, persist) | ((persist) ? RTDB_FIELD(RTDB_POINT_##id) : 0)
+#define RTDB_FIELD_PERSIST     (0 RTDB_POINT_TABLE(RTDB_POINT_PERSIST))
+
+#define RTDB_MAX_SUBSCRIBERS   4
+
+/**
+ * @struct RtdbSubscription
+ * @brief A consumer waiting for changes on a set of real-time database fields.
+ */
+typedef struct {
+    struct k_event changed;  ///< Posted with the mask of subscribed fields that changed.
+    uint32_t fields;  ///< RTDB_FIELD_* mask the subscriber is interested in.
+} RtdbSubscription;
+
+static RtdbSubscription *rtdb_subscribers[RTDB_MAX_SUBSCRIBERS];
+static atomic_t rtdb_subscriber_count;
+static struct k_spinlock rtdb_subscriber_lock;
+
+/**
+ * @brief Registers a subscriber for change notifications on the given fields.
+ *
+ * @param sub Subscription to register; must stay valid for the lifetime of the program.
+ * @param fields RTDB_FIELD_* mask of fields to be notified about.
+ * @return int Returns 0 on success, or -ENOMEM if all subscriber slots are taken.
+ */
+static inline int rtdb_subscribe(RtdbSubscription *sub, uint32_t fields) {
+    int ret = 0;
+
+    k_event_init(&sub->changed);
+    sub->fields = fields;
+
+    K_SPINLOCK(&rtdb_subscriber_lock) {
+        atomic_val_t count = atomic_get(&rtdb_subscriber_count);
+        if (count < RTDB_MAX_SUBSCRIBERS) {
+            rtdb_subscribers[count] = sub;
+            barrier_dmem_fence_full();  // Publish the slot before the count
+            atomic_inc(&rtdb_subscriber_count);
+        } else {
+            ret = -ENOMEM;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Blocks until one of the subscribed fields changes.
+ *
+ * The returned bits are cleared before returning, so the caller should read the database
+ * afterwards; a change arriving during that read is reported by the next call.
+ *
+ * @param sub Registered subscription.
+ * @param timeout How long to wait for a change.
+ * @return uint32_t Mask of subscribed fields that changed, or 0 on timeout.
+ */
+static inline uint32_t rtdb_wait_changes(RtdbSubscription *sub, k_timeout_t timeout) {
+    uint32_t changed = k_event_wait(&sub->changed, sub->fields, false, timeout);
+
+    k_event_clear(&sub->changed, changed);
+    return changed;
+}
+
+/**
+ * @brief Signals every subscriber interested in any of the changed fields.
+ *
+ * Safe to call from interrupt context.
+ *
+ * @param changed RTDB_FIELD_* mask of fields that were modified.
+ */
+static inline void rtdb_notify(uint32_t changed) {
+    atomic_val_t count = atomic_get(&rtdb_subscriber_count);
+
+    barrier_dmem_fence_full();
+    for (atomic_val_t i = 0; i < count; i++) {
+        RtdbSubscription *sub = rtdb_subscribers[i];
+        if (sub->fields & changed) {
+            k_event_post(&sub->changed, sub->fields & changed);
+        }
+    }
+}
+
+#define RTDB_LOCK_HIST_BUCKETS 16  // Bucket 0 is 0 cycles, bucket k is [2^(k-1), 2^k) cycles
+
+/**
+ * @brief Call sites that take the real-time database lock, used to attribute lock statistics.
+ */
+typedef enum {
+    RTDB_SITE_LED_TOGGLE,
+    RTDB_SITE_BUTTONS,
+    RTDB_SITE_DATABASE,
+    RTDB_SITE_RESTORE,
+    RTDB_SITE_ADC_CAL,
+    RTDB_SITE_COUNT
+} RtdbLockSite;
+
+#if RTDB_LOCK_STATS
+static const char *const rtdb_site_names[RTDB_SITE_COUNT] = {
+    [RTDB_SITE_LED_TOGGLE] = "led_toggle",
+    [RTDB_SITE_BUTTONS] = "buttons",
+    [RTDB_SITE_DATABASE] = "database",
+    [RTDB_SITE_RESTORE] = "restore",
+    [RTDB_SITE_ADC_CAL] = "adc_cal",
+};
+
+/**
+ * @struct RtdbLockStats
+ * @brief Cost of the write sections of one call site: hold time histogram in cycles, and the
+ *        lock-free reads they forced to repeat.
+ *
+ * On a single core a writer never waits for the spinlock, since holding it masks interrupts.
+ * What a write section costs the rest of the system is its length, during which interrupts are
+ * masked and readers that overlap it have to start over.
+ */
+typedef struct {
+    uint32_t acquisitions;  ///< Number of write sections opened by the site.
+    uint32_t hold_max;  ///< Longest section, from taking the lock to releasing it.
+    uint32_t hold_hist[RTDB_LOCK_HIST_BUCKETS];  ///< Log2 histogram of section lengths.
+    atomic_t read_retries;  ///< Lock-free reads repeated because a section of this site overlapped them.
+} RtdbLockStats;
+
+// Only updated while holding rtdb.lock, except read_retries; readers accept a slightly stale copy
+static RtdbLockStats rtdb_lock_stats[RTDB_SITE_COUNT];
+static atomic_t rtdb_lock_holder;  ///< RtdbLockSite of the last write section opened.
+static timing_t rtdb_lock_acquired;
+
+/**
+ * @brief Returns the log2 histogram bucket of a duration.
+ *
+ * @param cycles Duration in timing cycles.
+ * @return int Bucket index, 0 to RTDB_LOCK_HIST_BUCKETS - 1.
+ */
+static inline int rtdb_lock_bucket(uint64_t cycles) {
+    return MIN(find_msb_set((uint32_t)MIN(cycles, UINT32_MAX)), RTDB_LOCK_HIST_BUCKETS - 1);
+}
+#endif
+
+/**
+ * @brief Opens a write section on the real-time database.
+ *
+ * The spinlock serialises writers and, on a single core, also keeps the section from being
+ * preempted by a reader (even one in interrupt context), so readers
+ * never observe an odd sequence there. Keep the section to plain stores.
+ *
+ * @param site Call site opening the section, for the lock statistics.
+ * @return k_spinlock_key_t Key to pass to rtdb_write_end().
+ */
+static inline k_spinlock_key_t rtdb_write_begin(RtdbLockSite site) {
+    k_spinlock_key_t key = k_spin_lock(&rtdb.lock);
+#if RTDB_LOCK_STATS
+    rtdb_lock_acquired = timing_counter_get();
+    rtdb_lock_stats[site].acquisitions++;
+    atomic_set(&rtdb_lock_holder, site);
+#else
+    ARG_UNUSED(site);
+#endif
+    seqlock_write_begin(&rtdb.seq);
+    return key;
+}
+
+/**
+ * @brief Closes a write section opened with rtdb_write_begin() and notifies subscribers.
+ *
+ * @param key Key returned by rtdb_write_begin().
+ * @param changed RTDB_FIELD_* mask of fields modified in the section, or 0 if none.
+ */
+static inline void rtdb_write_end(k_spinlock_key_t key, uint32_t changed) {
+    if (changed) {
+        rtdb.version++;  // rtdb_store() already stamped the changed points with this version
+    }
+    seqlock_write_end(&rtdb.seq);
+#if RTDB_LOCK_STATS
+    timing_t released = timing_counter_get();
+    uint64_t hold = timing_cycles_get(&rtdb_lock_acquired, &released);
+    RtdbLockStats *stats = &rtdb_lock_stats[atomic_get(&rtdb_lock_holder)];
+
+    stats->hold_max = MAX(stats->hold_max, (uint32_t)MIN(hold, UINT32_MAX));
+    stats->hold_hist[rtdb_lock_bucket(hold)]++;
+#endif
+    k_spin_unlock(&rtdb.lock, key);
+
+    if (changed) {
+        rtdb_notify(changed);
+    }
+}
+
+/**
+ * @brief Starts a lock-free read of the real-time database.
+ *
+ * @return atomic_val_t Sequence value to pass to rtdb_read_retry() once the copy is done.
+ */
+static inline atomic_val_t rtdb_read_begin(void) {
+    return seqlock_read_begin(&rtdb.seq);
+}
+
+/**
+ * @brief Checks whether a lock-free read raced with a writer.
+ *
+ * @param seq Value returned by the matching rtdb_read_begin().
+ * @return true if the copied data may be torn and the read must be repeated.
+ */
+static inline bool rtdb_read_retry(atomic_val_t seq) {
+    if (!seqlock_read_retry(&rtdb.seq, seq)) {
+        return false;
+    }
+#if RTDB_LOCK_STATS
+    // Charged to the last section opened, the one that moved the sequence unless several did
+    atomic_inc(&rtdb_lock_stats[atomic_get(&rtdb_lock_holder)].read_retries);
+#endif
+    return true;
+}
+
+/**
+ * @brief Reads a single point of the real-time database without taking the lock.
+ *
+ * @param id Point to read.
+ * @return int32_t Stored value of the point.
+ */
+static inline int32_t rtdb_get(RtdbPointId id) {
+    atomic_val_t seq;
+    int32_t value;
+
+    do {
+        seq = rtdb_read_begin();
+        value = rtdb.data.points[id];
+    } while (rtdb_read_retry(seq));
+    return value;
+}
+
+/**
+ * @brief Current uptime in microseconds, the time base of sample and point timestamps.
+ *
+ * Read from the hardware cycle counter, so the resolution is that of the timer and not of
+ * CONFIG_SYS_CLOCK_TICKS_PER_SEC. A 32-bit counter is extended to 64 bits here, which only
+ * holds if it is read at least once per wrap: 36 h at the 32768 Hz of the nRF52 RTC, and the
+ * acquisition stamps every block.
+ */
+static inline int64_t rtdb_now_us(void) {
+#if IS_ENABLED(CONFIG_TIMER_HAS_64BIT_CYCLE_COUNTER)
+    return k_cyc_to_us_floor64(k_cycle_get_64());
+#else
+    static struct k_spinlock lock;
+    static uint64_t wraps;  // Upper 32 bits of the extended counter
+    static uint32_t last;
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t cycles = k_cycle_get_32();
+
+    if (cycles < last) {
+        wraps += BIT64(32);
+    }
+    last = cycles;
+    uint64_t extended = wraps | cycles;
+    k_spin_unlock(&lock, key);
+    return k_cyc_to_us_floor64(extended);
+#endif
+}
+
+/**
+ * @brief Reads a single point and the acquisition time of its value without taking the lock.
+ *
+ * @param id Point to read.
+ * @param timestamp_us Receives the uptime in microseconds at which the value was acquired.
+ * @return int32_t Stored value of the point.
+ */
+static inline int32_t rtdb_get_timed(RtdbPointId id, int64_t *timestamp_us) {
+    atomic_val_t seq;
+    int32_t value;
+
+    do {
+        seq = rtdb_read_begin();
+        value = rtdb.data.points[id];
+        *timestamp_us = rtdb.data.timestamp_us[id];
+    } while (rtdb_read_retry(seq));
+    return value;
+}
+
+/**
+ * @brief Age of a point value, for the query responses.
+ *
+ * @param timestamp_us Acquisition time of the value.
+ * @return uint32_t Microseconds since the value was acquired, saturated.
+ */
+static inline uint32_t rtdb_sample_age_us(int64_t timestamp_us) {
+    return MIN(rtdb_now_us() - timestamp_us, UINT32_MAX);
+}
+
+/**
+ * @brief Stores a point, coerced to its type. Must be called inside a write section.
+ *
+ * The timestamp is updated even if the value did not change, since the value is then
+ * confirmed by a newer reading.
+ *
+ * @param id Point to write.
+ * @param value New value.
+ * @param timestamp_us Uptime in microseconds at which the value was acquired.
+ * @return uint32_t RTDB_FIELD() mask of the point if its value changed, otherwise 0.
+ */
+static inline uint32_t rtdb_store(RtdbPointId id, int32_t value, int64_t timestamp_us) {
+    switch (rtdb_points[id].type) {
+        case RTDB_TYPE_BOOL:
+            value = (value != 0);
+            break;
+        case RTDB_TYPE_INT16:
+            value = CLAMP(value, INT16_MIN, INT16_MAX);
+            break;
+        default:
+            break;
+    }
+
+    rtdb.data.timestamp_us[id] = timestamp_us;
+    if (rtdb.data.points[id] == value) {
+        return 0;
+    }
+    rtdb.data.points[id] = value;
+    rtdb.generation[id] = rtdb.version + 1;
+    return RTDB_FIELD(id);
+}
+
+/**
+ * @struct RtdbTxn
+ * @brief Changes to several points staged outside the lock and published together.
+ */
+typedef struct {
+    uint32_t staged;  ///< RTDB_FIELD() mask of the points set in @c values.
+    uint32_t refresh;  ///< RTDB_FIELD() mask of the staged points published even if unchanged.
+    int64_t timestamp_us;  ///< Acquisition time of the staged values, 0 for the time of the commit.
+    int32_t values[RTDB_POINT_COUNT];  ///< Staged values indexed by RtdbPointId.
+} RtdbTxn;
+
+/**
+ * @brief Starts an empty write transaction.
+ *
+ * @param txn Transaction to initialise.
+ */
+static inline void rtdb_txn_begin(RtdbTxn *txn) {
+    txn->staged = 0;
+    txn->refresh = 0;
+    txn->timestamp_us = 0;
+}
+
+/**
+ * @brief Stages a point value in a transaction. Does not touch the database.
+ *
+ * @param txn Transaction started with rtdb_txn_begin().
+ * @param id Point to write.
+ * @param value New value.
+ */
+static inline void rtdb_txn_set(RtdbTxn *txn, RtdbPointId id, int32_t value) {
+    txn->values[id] = value;
+    txn->staged |= RTDB_FIELD(id);
+}
+
+/**
+ * @brief Stages a point value that is published as a change even if it is unchanged.
+ *
+ * The point gets a new generation and its subscribers are woken, so they can tell a steady
+ * value from a stalled writer.
+ *
+ * @param txn Transaction started with rtdb_txn_begin().
+ * @param id Point to write.
+ * @param value New value.
+ */
+static inline void rtdb_txn_refresh(RtdbTxn *txn, RtdbPointId id, int32_t value) {
+    rtdb_txn_set(txn, id, value);
+    txn->refresh |= RTDB_FIELD(id);
+}
+
+/**
+ * @brief Publishes all staged points in a single write section.
+ *
+ * Readers see either none or all of the staged changes, and subscribers are notified once
+ * for the whole batch.
+ *
+ * @param txn Transaction to commit.
+ * @param site Call site committing, for the lock statistics.
+ * @return uint32_t RTDB_FIELD() mask of the points whose value changed or that were refreshed.
+ */
+static inline uint32_t rtdb_txn_commit(const RtdbTxn *txn, RtdbLockSite site) {
+    uint32_t staged = txn->staged;
+    uint32_t changed = 0;
+
+    if (staged == 0) {
+        return 0;
+    }
+
+    int64_t timestamp_us = txn->timestamp_us != 0 ? txn->timestamp_us : rtdb_now_us();
+    k_spinlock_key_t key = rtdb_write_begin(site);
+    while (staged) {
+        int id = find_lsb_set(staged) - 1;
+        staged &= staged - 1;
+        changed |= rtdb_store(id, txn->values[id], timestamp_us);
+        if ((txn->refresh & RTDB_FIELD(id)) && !(changed & RTDB_FIELD(id))) {
+            rtdb.generation[id] = rtdb.version + 1;
+            changed |= RTDB_FIELD(id);
+        }
+    }
+    rtdb_write_end(key, changed);
+    return changed;
+}
+
+/**
+ * @brief Formats a point value in engineering units, e.g. "an_val=21.500degC".
+ *
+ * @param buf Destination buffer.
+ * @param len Size of @p buf.
+ * @param id Point the value belongs to.
+ * @param value Stored value of the point.
+ * @return int Number of characters written, as returned by snprintf.
+ */
+static inline int rtdb_point_format(char *buf, size_t len, RtdbPointId id, int32_t value) {
+    const RtdbPointMeta *meta = &rtdb_points[id];
+
+    if (meta->type != RTDB_TYPE_FIXED || meta->scale <= 1) {
+        return snprintf(buf, len, "%s=%d%s", meta->name, (int)value, meta->unit);
+    }
+
+    int digits = 0;
+    for (int32_t s = meta->scale; s > 1; s /= 10) {
+        digits++;
+    }
+    uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    return snprintf(buf, len, "%s=%s%u.%0*u%s", meta->name, value < 0 ? "-" : "",
+                    (unsigned)(magnitude / meta->scale), digits,
+                    (unsigned)(magnitude % meta->scale), meta->unit);
+}
+
+/**
+ * @brief Copies out a consistent view of the whole real-time database.
+ *
+ * The copy is taken with the lock-free sequence read, so all fields belong to the same
+ * write generation and writers are never stalled by the caller.
+ *
+ * @param out Destination for the snapshot.
+ */
+static inline void rtdb_snapshot(IoModuleData *out) {
+    atomic_val_t seq;
+
+    do {
+        seq = rtdb_read_begin();
+        memcpy(out, &rtdb.data, sizeof(*out));
+    } while (rtdb_read_retry(seq));
+}
+
+/**
+ * @brief Copies out the points modified after a given database version.
+ *
+ * Points and version are read in one consistent snapshot, so a client that passes the
+ * returned version to its next call never misses a change. Version 0 selects every point.
+ *
+ * @param since Database version the caller last saw.
+ * @param out Receives the values; only entries flagged in the returned mask are filled.
+ * @param generation Receives the version at which each flagged point last changed, so a
+ *        caller that can only pass part of the result on knows which version to resume from.
+ * @param version Receives the current database version.
+ * @return uint32_t RTDB_FIELD() mask of the points changed after @p since.
+ */
+static inline uint32_t rtdb_changed_since(uint32_t since, IoModuleData *out, uint32_t *generation, uint32_t *version) {
+    atomic_val_t seq;
+    uint32_t changed;
+
+    do {
+        seq = rtdb_read_begin();
+        changed = 0;
+        for (int id = 0; id < RTDB_POINT_COUNT; id++) {
+            if (since == 0 || (int32_t)(rtdb.generation[id] - since) > 0) {
+                out->points[id] = rtdb.data.points[id];
+                out->timestamp_us[id] = rtdb.data.timestamp_us[id];
+                generation[id] = rtdb.generation[id];
+                changed |= RTDB_FIELD(id);
+            }
+        }
+        *version = rtdb.version;
+    } while (rtdb_read_retry(seq));
+    return changed;
+}
+
+/**
+ * @brief Appends a sample to the history ring. Must only be called by the single writer.
+ *
+ * @param timestamp_us Acquisition time of the sample, see rtdb_now_us().
+ * @param raw Raw analog sensor value.
+ * @param value Processed analog sensor value.
+ */
+static inline void rtdb_history_append(int64_t timestamp_us, int16_t raw, int value) {
+    uint32_t head = (uint32_t)atomic_get(&rtdb.history.head);
+    RtdbSample *slot = &rtdb.history.samples[head & (RTDB_HISTORY_SIZE - 1)];
+
+    slot->timestamp_us = timestamp_us;
+    slot->raw = raw;
+    slot->value = value;
+    barrier_dmem_fence_full();  // Fill the slot before publishing it
+    atomic_set(&rtdb.history.head, (atomic_val_t)(head + 1));
+}
+
+/**
+ * @brief Copies the most recent samples of the history ring, oldest first.
+ *
+ * Never blocks the writer. Samples overwritten while the copy was in progress are dropped
+ * from the front of the result, so fewer than @p n samples may be returned.
+ *
+ * @param out Destination array.
+ * @param n Maximum number of samples to copy.
+ * @return size_t Number of samples copied to @p out.
+ */
+static inline size_t rtdb_history_last(RtdbSample *out, size_t n) {
+    uint32_t head = (uint32_t)atomic_get(&rtdb.history.head);
+    size_t count = MIN(n, MIN((size_t)head, (size_t)RTDB_HISTORY_SIZE));
+    uint32_t first = head - count;
+
+    barrier_dmem_fence_full();
+    for (size_t i = 0; i < count; i++) {
+        out[i] = rtdb.history.samples[(first + i) & (RTDB_HISTORY_SIZE - 1)];
+    }
+    barrier_dmem_fence_full();
+
+    // The writer may be filling the slot after the new head, which held the oldest entry
+    uint32_t lag = (uint32_t)atomic_get(&rtdb.history.head) - first;
+    if (lag > RTDB_HISTORY_SIZE - 1) {
+        size_t stale = MIN(count, (size_t)(lag - (RTDB_HISTORY_SIZE - 1)));
+        memmove(out, out + stale, (count - stale) * sizeof(*out));
+        count -= stale;
+    }
+    return count;
+}
+
+/**
+ * @brief Copies the samples stored at or after a given time, oldest first.
+ *
+ * If more than @p max samples qualify, the most recent @p max are returned.
+ *
+ * @param since_us Acquisition time of the oldest sample of interest, see rtdb_now_us().
+ * @param out Destination array.
+ * @param max Maximum number of samples to copy.
+ * @return size_t Number of samples copied to @p out.
+ */
+static inline size_t rtdb_history_since(int64_t since_us, RtdbSample *out, size_t max) {
+    size_t count = rtdb_history_last(out, max);
+    size_t skip = 0;
+
+    while (skip < count && out[skip].timestamp_us < since_us) {
+        skip++;
+    }
+    memmove(out, out + skip, (count - skip) * sizeof(*out));
+    return count - skip;
+}
+
+/**
+ * @brief Records an ADC offset calibration in the history and the adc_* points, in one write.
+ *
+ * @param cal Calibration to record.
+ */
+static inline void rtdb_adc_cal_append(const RtdbAdcCal *cal) {
+    k_spinlock_key_t key = rtdb_write_begin(RTDB_SITE_ADC_CAL);
+    uint32_t count = rtdb.data.points[RTDB_POINT_ADC_CALS];
+
+    rtdb.adc_cal[count % ADC_CAL_HISTORY_SIZE] = *cal;
+    uint32_t changed = rtdb_store(RTDB_POINT_ADC_CALS, count + 1, cal->timestamp_us);
+    changed |= rtdb_store(RTDB_POINT_ADC_OFFSET, cal->before, cal->timestamp_us);
+    changed |= rtdb_store(RTDB_POINT_ADC_RESIDUAL, cal->after, cal->timestamp_us);
+    rtdb_write_end(key, changed);
+}
+
+/**
+ * @brief Copies the recorded ADC offset calibrations, newest first.
+ *
+ * @param out Destination array of at least ADC_CAL_HISTORY_SIZE entries.
+ * @return size_t Number of calibrations copied to @p out.
+ */
+static inline size_t rtdb_adc_cal_history(RtdbAdcCal *out) {
+    atomic_val_t seq;
+    size_t count;
+
+    do {
+        seq = rtdb_read_begin();
+        uint32_t total = rtdb.data.points[RTDB_POINT_ADC_CALS];
+        count = MIN(total, ADC_CAL_HISTORY_SIZE);
+        for (size_t i = 0; i < count; i++) {
+            out[i] = rtdb.adc_cal[(total - 1 - i) % ADC_CAL_HISTORY_SIZE];
+        }
+    } while (rtdb_read_retry(seq));
+    return count;
+}
+
+#endif /* RTDB_H_ */
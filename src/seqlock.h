@@ -0,0 +1,67 @@
+/**
+ * @file seqlock.h
+ * @brief Sequence counter guarding data that is read without a lock.
+ *
+ * The writer makes the counter odd while it updates the data, and even again when it is done.
+ * Readers never block: they sample the counter, copy what they need and repeat the copy if
+ * the counter moved in the meantime. Writers must be serialised by the caller, under a
+ * spinlock so that on a single core no reader, even in interrupt context, can preempt a
+ * write and spin on an odd counter.
+ */
+
+#ifndef SEQLOCK_H_
+#define SEQLOCK_H_
+
+#include <stdbool.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/barrier.h>
+
+/**
+ * @brief Opens a write section. The caller must hold the lock serialising writers.
+ *
+ * @param seq Sequence counter of the data.
+ */
+static inline void seqlock_write_begin(atomic_t *seq) {
+    atomic_inc(seq);
+    barrier_dmem_fence_full();
+}
+
+/**
+ * @brief Closes a write section opened with seqlock_write_begin().
+ *
+ * @param seq Sequence counter of the data.
+ */
+static inline void seqlock_write_end(atomic_t *seq) {
+    barrier_dmem_fence_full();
+    atomic_inc(seq);
+}
+
+/**
+ * @brief Starts a lock-free read.
+ *
+ * @param seq Sequence counter of the data.
+ * @return atomic_val_t Value to pass to seqlock_read_retry() once the copy is done.
+ */
+static inline atomic_val_t seqlock_read_begin(atomic_t *seq) {
+    atomic_val_t start;
+
+    // Only another core can be mid-write here, see the writer rules above
+    while ((start = atomic_get(seq)) & 1) {
+    }
+    barrier_dmem_fence_full();
+    return start;
+}
+
+/**
+ * @brief Checks whether a lock-free read raced with a writer.
+ *
+ * @param seq Sequence counter of the data.
+ * @param start Value returned by the matching seqlock_read_begin().
+ * @return true if the copied data may be torn and the read must be repeated.
+ */
+static inline bool seqlock_read_retry(atomic_t *seq, atomic_val_t start) {
+    barrier_dmem_fence_full();
+    return atomic_get(seq) != start;
+}
+
+#endif /* SEQLOCK_H_ */
@@ -0,0 +1,206 @@
+/**
+ * @file main.c
+ * @brief Throughput and noise of the ADC resolution and oversampling modes, on adc_emul.
+ *
+ * The emulated channel reads a constant INPUT_MV plus a uniform noise of +-NOISE_MV, drawn from
+ * a fixed pseudo-random sequence. Each mode acquires BENCH_SAMPLES samples the way the
+ * application does: one sequence paced by the driver at BENCH_RATE_HZ, converted to mdegC with
+ * convert_block() on the linear curve. The achieved rate and the standard deviation of the
+ * samples are printed for every mode, as the 'n' UART command does on the board.
+ *
+ * The rate must be the tick-rounded rate of the acquisition timer, see adc_rate_ticks() in the
+ * application. The noise must stay within the input noise plus one quantization step, and
+ * follow the input noise once the step is smaller than it.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include <zephyr/drivers/adc.h>
+#include <zephyr/drivers/adc/adc_emul.h>
+#include "convert.h"
+
+#define ADC_NODE               DT_NODELABEL(adc0)
+#define ADC_CHANNEL            0
+#define BENCH_SAMPLES          200     // Samples per mode
+#define BENCH_RATE_HZ          1000    // Requested rate of every mode
+#define BENCH_RESOLUTION       12      // Resolution of the oversampling modes
+#define RESOLUTION_MIN         8       // Resolutions selectable at run time, in steps of 2 bits
+#define RESOLUTION_MAX         14
+#define OVERSAMPLING_MAX       8
+#define INPUT_MV               1505    // Constant input, 30.3 degC on the linear curve
+#define NOISE_MV               3       // Peak noise added to the input
+#define NOISE_SD_MDEGC         (2 * SENSOR_MDEGC_PER_MV)  // Standard deviation of that noise after conversion
+#define RATE_TOLERANCE_PERMILLE 20
+
+BUILD_ASSERT(BENCH_SAMPLES <= ADC_BLOCK_MAX, "One block per mode");
+
+static const struct device *const adc_dev = DEVICE_DT_GET(ADC_NODE);
+static const SensorConversion linear = { SENSOR_FULL_SCALE_MV, SENSOR_CURVE_LINEAR };
+static const SensorCalibration identity = { .gain_fract = CAL_GAIN_ONE };
+static int16_t raw[BENCH_SAMPLES];
+static int32_t value[BENCH_SAMPLES];
+static uint32_t noise_state;
+
+/**
+ * @brief Throughput and noise measured for one mode.
+ */
+typedef struct {
+    uint32_t rate_hz;  ///< Achieved sample rate.
+    uint32_t sd;  ///< Standard deviation of the converted samples, in mdegC.
+} ModeResult;
+
+/**
+ * @brief Input of the emulated channel: INPUT_MV plus a uniform integer noise of +-NOISE_MV,
+ *        whose standard deviation is 2 mV.
+ */
+static int noisy_input(const struct device *dev, unsigned int chan, void *data, uint32_t *result) {
+    noise_state = noise_state * 1103515245 + 12345;
+    *result = INPUT_MV + (int)((noise_state >> 16) % (2 * NOISE_MV + 1)) - NOISE_MV;
+    return 0;
+}
+
+/**
+ * @brief Integer square root, rounded down.
+ */
+static uint32_t isqrt64(uint64_t value) {
+    uint64_t root = 0;
+
+    for (uint64_t bit = 1ULL << 62; bit != 0; bit >>= 2) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return root;
+}
+
+/**
+ * @brief Requested rate rounded to whole ticks of the acquisition timer, as the driver runs it.
+ */
+static uint32_t tick_rounded_rate_hz(uint32_t rate) {
+    return CONFIG_SYS_CLOCK_TICKS_PER_SEC / MAX(k_us_to_ticks_ceil32(USEC_PER_SEC / rate), 1);
+}
+
+/**
+ * @brief Acquires and converts one block in a mode.
+ *
+ * @param resolution ADC resolution in bits.
+ * @param oversampling log2 of the conversions averaged into each sample.
+ * @param result Receives the rate and noise of the block.
+ * @return int 0 on success, or the error of adc_read().
+ */
+static int mode_run(uint8_t resolution, uint8_t oversampling, ModeResult *result) {
+    const struct adc_sequence_options options = {
+        .interval_us = USEC_PER_SEC / BENCH_RATE_HZ,
+        .extra_samplings = BENCH_SAMPLES - 1,
+    };
+    const struct adc_sequence sequence = {
+        .options = &options,
+        .channels = BIT(ADC_CHANNEL),
+        .buffer = raw,
+        .buffer_size = sizeof(raw),
+        .resolution = resolution,
+        .oversampling = oversampling,
+    };
+
+    noise_state = 1;
+    int64_t start = k_uptime_ticks();
+    int err = adc_read(adc_dev, &sequence);
+    int64_t elapsed = k_uptime_ticks() - start;
+    if (err != 0) {
+        return err;
+    }
+
+    convert_block(raw, resolution, &linear, &identity, value, BENCH_SAMPLES);
+    int64_t sum = 0;
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        sum += value[i];
+    }
+    int32_t mean = sum / BENCH_SAMPLES;
+    uint64_t sum_sq = 0;
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        int64_t deviation = value[i] - mean;
+        sum_sq += deviation * deviation;
+    }
+
+    // The first sample is taken at once, the others one interval apart
+    result->rate_hz = elapsed > 0 ? (BENCH_SAMPLES - 1) * CONFIG_SYS_CLOCK_TICKS_PER_SEC / elapsed : 0;
+    result->sd = isqrt64(sum_sq / (BENCH_SAMPLES - 1));
+    TC_PRINT("%ub x%u: %u samples/s sd %u mdegC (mean %d mdegC)\n", resolution, (unsigned)BIT(oversampling),
+             result->rate_hz, result->sd, mean);
+    return 0;
+}
+
+/**
+ * @brief Checks the rate of a mode against the tick-rounded rate of the timer.
+ */
+static void rate_check(const ModeResult *result, uint32_t expected_hz) {
+    uint32_t margin = expected_hz * RATE_TOLERANCE_PERMILLE / 1000;
+
+    zassert_within(result->rate_hz, expected_hz, margin, "%u samples/s instead of %u", result->rate_hz, expected_hz);
+}
+
+static void *adc_setup(void) {
+    const struct adc_channel_cfg channel_cfg = {
+        .gain = ADC_GAIN_1,
+        .reference = ADC_REF_INTERNAL,
+        .acquisition_time = ADC_ACQ_TIME_DEFAULT,
+        .channel_id = ADC_CHANNEL,
+    };
+
+    zassert_true(device_is_ready(adc_dev), "ADC not ready");
+    zassert_ok(adc_channel_setup(adc_dev, &channel_cfg), "Channel setup failed");
+    zassert_ok(adc_emul_value_func_set(adc_dev, ADC_CHANNEL, noisy_input, NULL), "No emulated input");
+    return NULL;
+}
+
+ZTEST_SUITE(adc_modes, NULL, adc_setup, NULL, NULL, NULL);
+
+/**
+ * @brief Every resolution runs at the timer rate; finer steps let the noise of the input through.
+ */
+ZTEST(adc_modes, test_resolution_modes) {
+    uint32_t expected_hz = tick_rounded_rate_hz(BENCH_RATE_HZ);
+
+    for (uint8_t bits = RESOLUTION_MIN; bits <= RESOLUTION_MAX; bits += 2) {
+        // One quantization step, in mdegC
+        uint32_t step = SENSOR_FULL_SCALE_MV * SENSOR_MDEGC_PER_MV / ADC_FULL_SCALE(bits);
+        ModeResult result;
+
+        zassert_ok(mode_run(bits, 0, &result), "Acquisition failed at %u bits", bits);
+        rate_check(&result, expected_hz);
+        zassert_true(result.sd <= NOISE_SD_MDEGC + step, "%u bits: sd %u mdegC above the input noise",
+                     bits, result.sd);
+        if (step < NOISE_SD_MDEGC) {
+            zassert_true(result.sd >= NOISE_SD_MDEGC / 2, "%u bits: sd %u mdegC, the input noise is lost",
+                         bits, result.sd);
+        }
+    }
+}
+
+/**
+ * @brief Oversampling keeps the rate while it fits in the sample period, and never adds noise.
+ *
+ * adc_emul does not implement hardware oversampling; the test is skipped when the driver turns
+ * it down, and the oversampling modes can only be measured on the board with 'n'.
+ */
+ZTEST(adc_modes, test_oversampling_modes) {
+    uint32_t expected_hz = tick_rounded_rate_hz(BENCH_RATE_HZ);
+    ModeResult base;
+
+    zassert_ok(mode_run(BENCH_RESOLUTION, 0, &base), "Acquisition failed");
+    for (uint8_t oversampling = 1; oversampling <= OVERSAMPLING_MAX; oversampling++) {
+        ModeResult result;
+        int err = mode_run(BENCH_RESOLUTION, oversampling, &result);
+
+        if (err == -ENOTSUP || err == -EINVAL) {
+            ztest_test_skip();
+        }
+        zassert_ok(err, "Acquisition failed with oversampling x%u", (unsigned)BIT(oversampling));
+        rate_check(&result, expected_hz);
+        zassert_true(result.sd <= base.sd, "x%u: sd %u mdegC above %u mdegC without oversampling",
+                     (unsigned)BIT(oversampling), result.sd, base.sd);
+    }
+}
@@ -0,0 +1,144 @@
+/**
+ * @file main.c
+ * @brief Accuracy and cost of the sample conversion paths and of the block kernels.
+ *
+ * The tests run the conversion of the application from convert.h. Every code of every ADC
+ * resolution is converted on the linear curve, by the fixed point and the float table lookups,
+ * and compared with the float formula the processing stage used before the tables. Then every
+ * 10-bit code is timed, one ADC_BLOCK_MAX block at a time, through the float formula, both
+ * lookups and the FIR and mean kernels. The cycles per sample are printed, and the fixed point
+ * path must beat both float ones.
+ */
+
+#include <stdlib.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include "convert.h"
+
+#define BENCH_RESOLUTION       10      // ADC resolution at boot
+#define RESOLUTION_MIN         8       // Resolutions selectable at run time, in steps of 2 bits
+#define RESOLUTION_MAX         14
+
+static int16_t raw[ADC_BLOCK_MAX];
+static int32_t value[ADC_BLOCK_MAX];
+static int32_t filtered[ADC_BLOCK_MAX];
+static DspFir fir;
+static const SensorConversion linear = { SENSOR_FULL_SCALE_MV, SENSOR_CURVE_LINEAR };
+static const SensorCalibration identity = { .gain_fract = CAL_GAIN_ONE };
+
+/**
+ * @brief Conversion paths of a block, as the processing stage runs them.
+ */
+typedef enum {
+    PATH_FORMULA,  ///< convert_raw_float() on every sample, the original conversion.
+    PATH_LUT_FLOAT,  ///< calibration_lut_block_float() and the calibration, PROCESSING_FIXED_POINT 0.
+    PATH_LUT_FIXED,  ///< calibration_lut_block_fixed() and the calibration, PROCESSING_FIXED_POINT 1.
+    PATH_COUNT
+} ConvertPath;
+
+static const char *const path_names[PATH_COUNT] = { "formula", "lut-float", "lut-fixed" };
+
+/**
+ * @brief Converts raw[0..count) into value[] on one path.
+ */
+static void convert_path(ConvertPath path, uint8_t resolution, uint32_t count) {
+    switch (path) {
+        case PATH_FORMULA:
+            for (uint32_t i = 0; i < count; i++) {
+                value[i] = convert_raw_float(raw[i], resolution, SENSOR_FULL_SCALE_MV);
+            }
+            break;
+        case PATH_LUT_FLOAT:
+            calibration_lut_block_float(raw, resolution, &linear, value, count);
+            calibration_apply_block(&identity, value, count);
+            break;
+        default:
+            calibration_lut_block_fixed(raw, resolution, &linear, value, count);
+            calibration_apply_block(&identity, value, count);
+            break;
+    }
+}
+
+/**
+ * @brief Fills raw[] with consecutive codes from @p first, up to the full scale of @p resolution.
+ *
+ * @return uint32_t Number of codes in the block.
+ */
+static uint32_t codes_fill(int first, uint8_t resolution) {
+    uint32_t count = MIN(ADC_BLOCK_MAX, ADC_FULL_SCALE(resolution) + 1 - first);
+
+    for (uint32_t i = 0; i < count; i++) {
+        raw[i] = first + i;
+    }
+    return count;
+}
+
+ZTEST_SUITE(convert_kernels, NULL, NULL, NULL, NULL, NULL);
+
+/**
+ * @brief Both table lookups follow the float formula within CONVERT_TOLERANCE at every resolution.
+ */
+ZTEST(convert_kernels, test_linear_within_tolerance) {
+    for (ConvertPath path = PATH_LUT_FLOAT; path < PATH_COUNT; path++) {
+        int32_t max_error = 0;
+
+        for (uint8_t bits = RESOLUTION_MIN; bits <= RESOLUTION_MAX; bits += 2) {
+            for (int first = 0; first <= ADC_FULL_SCALE(bits); first += ADC_BLOCK_MAX) {
+                uint32_t count = codes_fill(first, bits);
+                convert_path(path, bits, count);
+                for (uint32_t i = 0; i < count; i++) {
+                    int32_t error = abs(value[i] - convert_raw_float(raw[i], bits, SENSOR_FULL_SCALE_MV));
+                    max_error = MAX(max_error, error);
+                }
+            }
+        }
+        TC_PRINT("%s: max error %d mdegC\n", path_names[path], max_error);
+        zassert_true(max_error <= CONVERT_TOLERANCE, "%s off by %d mdegC", path_names[path], max_error);
+    }
+}
+
+/**
+ * @brief Cycles per sample of each path and kernel over every 10-bit code.
+ */
+ZTEST(convert_kernels, test_fixed_point_faster) {
+    uint64_t path_cycles[PATH_COUNT] = { 0 };
+    uint64_t fir_cycles = 0;
+    uint64_t mean_cycles = 0;
+    uint32_t samples = 0;
+    volatile int32_t sink;  // Keeps the mean from being optimized out
+    uint32_t start;
+
+    dsp_fir_init(&fir);
+    for (int first = 0; first <= ADC_FULL_SCALE(BENCH_RESOLUTION); first += ADC_BLOCK_MAX) {
+        uint32_t count = codes_fill(first, BENCH_RESOLUTION);
+
+        for (ConvertPath path = 0; path < PATH_COUNT; path++) {
+            start = k_cycle_get_32();
+            convert_path(path, BENCH_RESOLUTION, count);
+            path_cycles[path] += k_cycle_get_32() - start;
+        }
+
+        start = k_cycle_get_32();
+        dsp_fir_q31(&fir, value, filtered, count);
+        fir_cycles += k_cycle_get_32() - start;
+
+        start = k_cycle_get_32();
+        sink = dsp_mean_q31(value, count);
+        mean_cycles += k_cycle_get_32() - start;
+        samples += count;
+    }
+    (void)sink;
+
+    TC_PRINT("cycles/sample over %u codes (%s kernels):", samples, PROCESSING_CMSIS_DSP ? "cmsis-dsp" : "scalar");
+    for (ConvertPath path = 0; path < PATH_COUNT; path++) {
+        TC_PRINT(" %s %u.%02u", path_names[path], (uint32_t)(path_cycles[path] / samples),
+                 (uint32_t)(path_cycles[path] * 100 / samples % 100));
+    }
+    TC_PRINT(" fir %u.%02u mean %u.%02u\n", (uint32_t)(fir_cycles / samples),
+             (uint32_t)(fir_cycles * 100 / samples % 100), (uint32_t)(mean_cycles / samples),
+             (uint32_t)(mean_cycles * 100 / samples % 100));
+
+    zassert_true(path_cycles[PATH_LUT_FIXED] > 0, "Clock did not advance, run on a target with a counted clock");
+    zassert_true(path_cycles[PATH_LUT_FIXED] < path_cycles[PATH_FORMULA], "Fixed point not faster than the formula");
+    zassert_true(path_cycles[PATH_LUT_FIXED] < path_cycles[PATH_LUT_FLOAT], "Fixed point not faster than the float lookup");
+}
@@ -0,0 +1,352 @@
+/**
+ * @file main.c
+ * @brief Samples per second through the sensor pipeline: per sample vs blocks, threaded vs fused.
+ *
+ * Both cases run the three stages of the application at its priorities: a sampler at 7, the
+ * processing stage at 6 and the database stage at 5. Every stage does the same trivial work on
+ * each sample, so the difference is the cost of moving samples between the stages:
+ *
+ * - per sample: the original transport, one int16_t per k_msgq_put into the processing stage and
+ *   one SensorData per k_msgq_put into the database stage, both queues 10 deep;
+ * - blocks: the current transport from pipeline.h, BENCH_BLOCK_LEN samples per SampleBuffer
+ *   taken from sample_slab and passed by pointer through two PipelineQueue, with the depths of
+ *   the application and SAMPLE_BUFFER_COUNT buffers in flight.
+ *
+ * The rates are printed with the queue counters, and the block transport must beat the
+ * per-sample one.
+ *
+ * The sweep then drives the block pipeline from a k_timer standing in for the ADC callback, with
+ * the overflow policy of the application, in both build modes of the application:
+ *
+ * - threaded: the timer queues each block for the processing thread at 6, which hands it to the
+ *   database thread at 5;
+ * - fused: the timer queues the block and submits a work item to a queue at 5, whose handler
+ *   converts and stores every queued block in one pass.
+ *
+ * The block rate goes up step by step until a block is dropped or the pool runs dry. The highest
+ * rate sustained by each mode is printed with the CPU load measured at that rate, and the fused
+ * pipeline must sustain at least the rate of the threaded one.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#define BENCH_SAMPLES          20000   // Samples pushed through the pipeline in each case
+#define BENCH_BLOCK_LEN        100     // Samples per block, ADC_BLOCK_PERIOD_MS of signal at 1 kHz
+#define MSGQ_DEPTH             10      // Depth of the original message queues
+#define QUEUE_ADC_RAW_DEPTH    2       // Depths of the application queues
+#define QUEUE_SENSOR_DATA_DEPTH 1
+#define STAGE_STACK_SIZE       1024
+#define SWEEP_BLOCK_LEN        16      // Samples per block in the sweep, small so the per-block cost shows
+#define SWEEP_FIRST_TICKS      100     // Block period of the first step, 10 ms at 10 kHz ticks
+#define SWEEP_STEP_MS          200     // Length of each step
+#define SWEEP_DRAIN_MS         100     // Longest wait for the pipeline to empty after a step
+
+#define ADC_BLOCK_MAX          BENCH_BLOCK_LEN  // Keeps the buffers small, the queues do not depend on it
+#include "pipeline.h"
+
+BUILD_ASSERT(BENCH_SAMPLES % BENCH_BLOCK_LEN == 0, "Whole blocks only");
+
+/**
+ * @struct SensorData
+ * @brief Message of the original per-sample transport into the database stage.
+ */
+typedef struct {
+    int16_t raw_value;
+    int32_t value;
+} SensorData;
+
+K_MSGQ_DEFINE(msgq_adc_raw, sizeof(int16_t), MSGQ_DEPTH, 4);
+K_MSGQ_DEFINE(msgq_sensor_data, sizeof(SensorData), MSGQ_DEPTH, 4);
+// Every stage is a thread here, so both queues can block instead of dropping like the ADC callback
+PIPELINE_QUEUE_DEFINE(queue_adc_raw, QUEUE_ADC_RAW_DEPTH, QUEUE_BLOCK);
+PIPELINE_QUEUE_DEFINE(queue_sensor_data, QUEUE_SENSOR_DATA_DEPTH, QUEUE_BLOCK);
+K_SEM_DEFINE(bench_done, 0, 1);
+
+K_THREAD_STACK_DEFINE(sampler_stack, STAGE_STACK_SIZE);
+K_THREAD_STACK_DEFINE(process_stack, STAGE_STACK_SIZE);
+K_THREAD_STACK_DEFINE(database_stack, STAGE_STACK_SIZE);
+static struct k_thread sampler_thread;
+static struct k_thread process_thread;
+static struct k_thread database_thread;
+
+static volatile int32_t database_value;  // Stands in for the RTDB point
+
+K_THREAD_STACK_DEFINE(fused_stack, STAGE_STACK_SIZE);
+static struct k_work_q fused_work_q;
+static bool sweep_fused;  // The timer submits fused_work instead of waking the processing thread
+static atomic_t sweep_overruns;  // Blocks lost because no sample buffer was free
+static uint32_t sweep_sequence;
+
+/**
+ * @brief Stand-in for the ADC: a sawtooth over the 10-bit range.
+ */
+static inline int16_t sample_next(uint32_t i) {
+    return i & 0x3ff;
+}
+
+/**
+ * @brief Stand-in for the conversion, millidegrees from a 10-bit count over 3 V.
+ */
+static inline int32_t sample_convert(int16_t raw) {
+    return raw * 176 - 60000;
+}
+
+static void sampler_per_sample(void *p1, void *p2, void *p3) {
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+        int16_t raw = sample_next(i);
+        k_msgq_put(&msgq_adc_raw, &raw, K_FOREVER);
+    }
+}
+
+static void process_per_sample(void *p1, void *p2, void *p3) {
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+        SensorData data;
+        k_msgq_get(&msgq_adc_raw, &data.raw_value, K_FOREVER);
+        data.value = sample_convert(data.raw_value);
+        k_msgq_put(&msgq_sensor_data, &data, K_FOREVER);
+    }
+}
+
+static void database_per_sample(void *p1, void *p2, void *p3) {
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+        SensorData data;
+        k_msgq_get(&msgq_sensor_data, &data, K_FOREVER);
+        database_value = data.value;
+    }
+    k_sem_give(&bench_done);
+}
+
+static void sampler_blocks(void *p1, void *p2, void *p3) {
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i += BENCH_BLOCK_LEN) {
+        SampleBuffer *buf;
+        while ((buf = sample_buffer_alloc()) == NULL) {
+            k_sleep(K_TICKS(1));  // Counted in sample_pool_exhausted, the test fails on it
+        }
+        for (uint16_t j = 0; j < BENCH_BLOCK_LEN; j++) {
+            buf->raw[0][j] = sample_next(i + j);
+        }
+        buf->info.count = BENCH_BLOCK_LEN;
+        pipeline_queue_put(&queue_adc_raw, buf, K_FOREVER);
+    }
+}
+
+static void process_blocks(void *p1, void *p2, void *p3) {
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i += BENCH_BLOCK_LEN) {
+        SampleBuffer *buf = pipeline_queue_get(&queue_adc_raw, K_FOREVER);
+        for (uint16_t j = 0; j < buf->info.count; j++) {
+            buf->value[0][j] = sample_convert(buf->raw[0][j]);
+        }
+        pipeline_queue_put(&queue_sensor_data, buf, K_FOREVER);
+    }
+}
+
+static void database_blocks(void *p1, void *p2, void *p3) {
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i += BENCH_BLOCK_LEN) {
+        SampleBuffer *buf = pipeline_queue_get(&queue_sensor_data, K_FOREVER);
+        for (uint16_t j = 0; j < buf->info.count; j++) {
+            database_value = buf->value[0][j];
+        }
+        sample_buffer_free(buf);
+    }
+    k_sem_give(&bench_done);
+}
+
+/**
+ * @brief Runs the three stages until the database stage has seen every sample.
+ *
+ * @return uint32_t Samples per second.
+ */
+static uint32_t bench_run(k_thread_entry_t sampler, k_thread_entry_t process, k_thread_entry_t database) {
+    uint32_t start = k_cycle_get_32();
+
+    k_thread_create(&database_thread, database_stack, K_THREAD_STACK_SIZEOF(database_stack),
+                    database, NULL, NULL, NULL, 5, 0, K_NO_WAIT);
+    k_thread_create(&process_thread, process_stack, K_THREAD_STACK_SIZEOF(process_stack),
+                    process, NULL, NULL, NULL, 6, 0, K_NO_WAIT);
+    k_thread_create(&sampler_thread, sampler_stack, K_THREAD_STACK_SIZEOF(sampler_stack),
+                    sampler, NULL, NULL, NULL, 7, 0, K_NO_WAIT);
+    k_sem_take(&bench_done, K_FOREVER);
+
+    uint64_t elapsed_ns = k_cyc_to_ns_floor64(k_cycle_get_32() - start);
+    k_thread_join(&sampler_thread, K_FOREVER);
+    k_thread_join(&process_thread, K_FOREVER);
+    k_thread_join(&database_thread, K_FOREVER);
+    zassert_true(elapsed_ns > 0, "Clock did not advance, run on a target with a real or counted clock");
+    return (uint64_t)BENCH_SAMPLES * NSEC_PER_SEC / elapsed_ns;
+}
+
+static void sweep_convert(SampleBuffer *buf) {
+    for (uint16_t j = 0; j < buf->info.count; j++) {
+        buf->value[0][j] = sample_convert(buf->raw[0][j]);
+    }
+}
+
+static void sweep_store(SampleBuffer *buf) {
+    for (uint16_t j = 0; j < buf->info.count; j++) {
+        database_value = buf->value[0][j];
+    }
+    sample_buffer_free(buf);
+}
+
+static void process_sweep(void *p1, void *p2, void *p3) {
+    while (1) {
+        SampleBuffer *buf = pipeline_queue_get(&queue_adc_raw, K_FOREVER);
+        sweep_convert(buf);
+        pipeline_queue_put(&queue_sensor_data, buf, K_FOREVER);
+    }
+}
+
+static void database_sweep(void *p1, void *p2, void *p3) {
+    while (1) {
+        sweep_store(pipeline_queue_get(&queue_sensor_data, K_FOREVER));
+    }
+}
+
+/**
+ * @brief Fused stage, as pipeline_work_handler() in the application.
+ */
+static void fused_handler(struct k_work *work) {
+    SampleBuffer *buf;
+
+    while ((buf = pipeline_queue_get(&queue_adc_raw, K_NO_WAIT)) != NULL) {
+        sweep_convert(buf);
+        sweep_store(buf);
+    }
+}
+
+K_WORK_DEFINE(fused_work, fused_handler);
+
+/**
+ * @brief Sampler of the sweep, in interrupt context like the ADC callback: one block per expiry.
+ */
+static void sweep_timer_expiry(struct k_timer *timer) {
+    SampleBuffer *buf = sample_buffer_alloc();
+
+    if (buf == NULL) {
+        atomic_inc(&sweep_overruns);
+        return;
+    }
+    for (uint16_t j = 0; j < SWEEP_BLOCK_LEN; j++) {
+        buf->raw[0][j] = sample_next(sweep_sequence * SWEEP_BLOCK_LEN + j);
+    }
+    buf->info.sequence = sweep_sequence++;
+    buf->info.count = SWEEP_BLOCK_LEN;
+    if (pipeline_queue_put(&queue_adc_raw, buf, K_NO_WAIT) == 0 && sweep_fused) {
+        k_work_submit_to_queue(&fused_work_q, &fused_work);
+    }
+}
+
+K_TIMER_DEFINE(sweep_timer, sweep_timer_expiry, NULL);
+
+/**
+ * @brief Feeds the pipeline one block every @p period_ticks for SWEEP_STEP_MS.
+ *
+ * @param period_ticks Block period.
+ * @param load Receives the CPU load over the step, in 0.01 %.
+ * @return true if every block made it to the database stage.
+ */
+static bool sweep_step(uint32_t period_ticks, uint32_t *load) {
+    k_thread_runtime_stats_t before, after;
+
+    atomic_clear(&sweep_overruns);
+    atomic_clear(&queue_adc_raw.dropped);
+    k_thread_runtime_stats_all_get(&before);
+    k_timer_start(&sweep_timer, K_TICKS(period_ticks), K_TICKS(period_ticks));
+    k_msleep(SWEEP_STEP_MS);
+    k_timer_stop(&sweep_timer);
+    k_thread_runtime_stats_all_get(&after);
+
+    uint64_t elapsed = after.execution_cycles - before.execution_cycles;
+    uint64_t busy = elapsed - (after.idle_cycles - before.idle_cycles);
+    *load = elapsed ? busy * 10000 / elapsed : 0;
+
+    for (int ms = 0; k_mem_slab_num_used_get(&sample_slab) != 0; ms++) {
+        zassert_true(ms < SWEEP_DRAIN_MS, "Pipeline did not drain");
+        k_msleep(1);
+    }
+    return atomic_get(&sweep_overruns) == 0 && atomic_get(&queue_adc_raw.dropped) == 0;
+}
+
+/**
+ * @brief Raises the block rate until the pipeline drops a block.
+ *
+ * @param fused Run the fused work item instead of the processing and database threads.
+ * @param max_load Receives the CPU load at the highest sustained rate, in 0.01 %.
+ * @return uint32_t Highest sustained rate in samples per second, 0 if even the first step failed.
+ */
+static uint32_t sweep_run(bool fused, uint32_t *max_load) {
+    const char *mode = fused ? "fused" : "threaded";
+    uint32_t max_rate = 0;
+
+    sweep_fused = fused;
+    if (!fused) {
+        k_thread_create(&database_thread, database_stack, K_THREAD_STACK_SIZEOF(database_stack),
+                        database_sweep, NULL, NULL, NULL, 5, 0, K_NO_WAIT);
+        k_thread_create(&process_thread, process_stack, K_THREAD_STACK_SIZEOF(process_stack),
+                        process_sweep, NULL, NULL, NULL, 6, 0, K_NO_WAIT);
+    }
+
+    *max_load = 0;
+    for (uint32_t period = SWEEP_FIRST_TICKS; period > 0; period = MIN(period - 1, period * 3 / 4)) {
+        uint32_t rate = SWEEP_BLOCK_LEN * CONFIG_SYS_CLOCK_TICKS_PER_SEC / period;
+        uint32_t load;
+        bool sustained = sweep_step(period, &load);
+
+        TC_PRINT("%s %u samples/s: load %u.%02u%%%s\n", mode, rate, load / 100, load % 100,
+                 sustained ? "" : ", dropped");
+        if (!sustained) {
+            break;
+        }
+        max_rate = rate;
+        *max_load = load;
+    }
+
+    if (!fused) {
+        k_thread_abort(&process_thread);  // Both wait on an empty queue, holding no buffer
+        k_thread_abort(&database_thread);
+    }
+    return max_rate;
+}
+
+static void *pipeline_setup(void) {
+    k_work_queue_start(&fused_work_q, fused_stack, K_THREAD_STACK_SIZEOF(fused_stack), 5, NULL);
+    return NULL;
+}
+
+ZTEST_SUITE(pipeline_transport, NULL, pipeline_setup, NULL, NULL, NULL);
+
+ZTEST(pipeline_transport, test_blocks_outrun_per_sample) {
+    char line[96];
+    uint32_t per_sample = bench_run(sampler_per_sample, process_per_sample, database_per_sample);
+    uint32_t blocks = bench_run(sampler_blocks, process_blocks, database_blocks);
+
+    TC_PRINT("per sample: %u samples/s\n", per_sample);
+    TC_PRINT("blocks of %u: %u samples/s (x%u.%02u), pool high-water %u/%u\n", BENCH_BLOCK_LEN, blocks,
+             blocks / per_sample, (uint32_t)((uint64_t)blocks * 100 / per_sample % 100),
+             (unsigned)atomic_get(&sample_pool_high_water), SAMPLE_BUFFER_COUNT);
+    pipeline_queue_format(line, sizeof(line), &queue_adc_raw);
+    TC_PRINT("%s", line);
+    pipeline_queue_format(line, sizeof(line), &queue_sensor_data);
+    TC_PRINT("%s", line);
+    zassert_equal(atomic_get(&sample_pool_exhausted), 0, "Sampler ran out of buffers");
+    zassert_equal(atomic_get(&queue_adc_raw.dropped) + atomic_get(&queue_sensor_data.dropped), 0,
+                  "Blocks were dropped");
+    zassert_true(blocks > per_sample, "Block transport is not faster");
+}
+
+ZTEST(pipeline_transport, test_fused_sustains_threaded_rate) {
+    uint32_t threaded_load, fused_load;
+
+    // The timer is the ADC callback here, so the raw queue drops like in the application
+    atomic_set(&queue_adc_raw.policy, QUEUE_DROP_OLDEST);
+    uint32_t threaded = sweep_run(false, &threaded_load);
+    uint32_t fused = sweep_run(true, &fused_load);
+    atomic_set(&queue_adc_raw.policy, QUEUE_BLOCK);
+
+    TC_PRINT("max sustained, blocks of %u: threaded %u samples/s at %u.%02u%% CPU, "
+             "fused %u samples/s at %u.%02u%% CPU\n", SWEEP_BLOCK_LEN, threaded,
+             threaded_load / 100, threaded_load % 100, fused, fused_load / 100, fused_load % 100);
+    zassert_true(threaded > 0 && fused > 0, "Pipeline dropped blocks at the slowest rate");
+    zassert_true(fused >= threaded, "Fused pipeline sustains less than the threaded one");
+}
@@ -0,0 +1,289 @@
+/**
+ * @file main.c
+ * @brief Read consistency of the RTDB sequence lock, and the latency of its change notifications.
+ *
+ * The tests run the database of the application from rtdb.h. In rtdb_seqlock, a writer thread
+ * stores the same generation number in every point through rtdb_write_begin()/rtdb_store()/
+ * rtdb_write_end(), stamped with that number too. The test thread reads the points while the
+ * writer preempts it, and checks that no copy ever mixes two generations.
+ *
+ * In rtdb_notify, the test thread toggles an LED point the way the UART command does, and a
+ * consumer at the priority of led_thread reports when it sees the change: once polling every
+ * 100 ms as led_thread did before the subscriptions, once waiting on a subscription.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+#include "rtdb.h"
+
+#define TEST_DURATION_MS       500     // Length of each read loop
+#define COPY_DELAY_US          2       // Busy wait between two points, widens the race window
+#define WRITER_PERIOD_US       100     // Pause of the writer between two updates
+#define WRITER_STACK_SIZE      1024
+#define WRITER_PRIORITY        K_PRIO_PREEMPT(1)
+#define READER_PRIORITY        K_PRIO_PREEMPT(5)
+#define TOGGLE_COUNT           20      // LED toggles timed for each consumer
+#define POLL_PERIOD_MS         100     // Polling period of the former led_thread
+#define CONSUMER_PRIORITY      K_PRIO_PREEMPT(7)  // Priority of led_thread
+#define TOGGLER_PRIORITY       K_PRIO_PREEMPT(8)  // Below the consumer, as the UART interrupt is above it
+
+static atomic_t writer_stop;
+static atomic_t writer_updates;
+
+K_THREAD_STACK_DEFINE(writer_stack, WRITER_STACK_SIZE);
+static struct k_thread writer_thread;
+K_THREAD_STACK_DEFINE(consumer_stack, WRITER_STACK_SIZE);
+static struct k_thread consumer_thread;
+
+/**
+ * @brief Ways the test thread copies the database.
+ */
+typedef enum {
+    READ_UNGUARDED,  ///< Slow copy without the sequence lock.
+    READ_GUARDED,    ///< Slow copy inside rtdb_read_begin()/rtdb_read_retry().
+    READ_SNAPSHOT,   ///< rtdb_snapshot() as the application calls it.
+} ReadMode;
+
+/**
+ * @brief Writer: publishes a new generation in every point, then sleeps a little.
+ */
+static void writer(void *p1, void *p2, void *p3) {
+    int32_t generation = 0;
+
+    while (!atomic_get(&writer_stop)) {
+        generation++;
+        k_spinlock_key_t key = rtdb_write_begin(RTDB_SITE_DATABASE);
+        uint32_t changed = 0;
+        for (int id = 0; id < RTDB_POINT_COUNT; id++) {
+            changed |= rtdb_store(id, generation, generation);
+        }
+        rtdb_write_end(key, changed);
+        atomic_inc(&writer_updates);
+        k_usleep(WRITER_PERIOD_US);
+    }
+}
+
+/**
+ * @brief Copies the points slowly, so the writer gets to run in the middle of the copy.
+ */
+static void points_copy(IoModuleData *out) {
+    for (int id = 0; id < RTDB_POINT_COUNT; id++) {
+        out->points[id] = rtdb.data.points[id];
+        out->timestamp_us[id] = rtdb.data.timestamp_us[id];
+        k_busy_wait(COPY_DELAY_US);
+    }
+}
+
+/**
+ * @brief Value rtdb_store() keeps for a point written with @p generation.
+ */
+static int32_t point_expected(RtdbPointId id, int64_t generation) {
+    switch (rtdb_points[id].type) {
+        case RTDB_TYPE_BOOL:
+            return generation != 0;
+        case RTDB_TYPE_INT16:
+            return CLAMP(generation, INT16_MIN, INT16_MAX);
+        default:
+            return generation;
+    }
+}
+
+/**
+ * @brief Tells whether a copy holds more than one generation.
+ */
+static bool points_torn(const IoModuleData *copy) {
+    int64_t generation = copy->timestamp_us[0];
+
+    for (int id = 0; id < RTDB_POINT_COUNT; id++) {
+        if (copy->timestamp_us[id] != generation || copy->points[id] != point_expected(id, generation)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Runs copies for TEST_DURATION_MS against the writer.
+ *
+ * @param mode How to copy the database.
+ * @param torn Receives the number of copies mixing two generations.
+ * @param retries Receives the number of guarded copies the sequence lock had repeated.
+ * @return uint32_t Number of copies taken.
+ */
+static uint32_t read_loop(ReadMode mode, uint32_t *torn, uint32_t *retries) {
+    int64_t end = k_uptime_get() + TEST_DURATION_MS;
+    uint32_t reads = 0;
+    IoModuleData copy;
+
+    *torn = 0;
+    *retries = 0;
+    k_thread_create(&writer_thread, writer_stack, K_THREAD_STACK_SIZEOF(writer_stack),
+                    writer, NULL, NULL, NULL, WRITER_PRIORITY, 0, K_NO_WAIT);
+
+    while (k_uptime_get() < end) {
+        if (mode == READ_GUARDED) {
+            atomic_val_t seq = rtdb_read_begin();
+            points_copy(&copy);
+            while (rtdb_read_retry(seq)) {
+                (*retries)++;
+                seq = rtdb_read_begin();
+                points_copy(&copy);
+            }
+        } else if (mode == READ_SNAPSHOT) {
+            rtdb_snapshot(&copy);
+            k_busy_wait(COPY_DELAY_US * RTDB_POINT_COUNT);  // Same pace, and lets time advance on native_sim
+        } else {
+            points_copy(&copy);
+        }
+        *torn += points_torn(&copy);
+        reads++;
+    }
+
+    atomic_set(&writer_stop, 1);
+    k_thread_join(&writer_thread, K_FOREVER);
+    return reads;
+}
+
+/**
+ * @brief Runs in the thread of each test, before it.
+ */
+static void rtdb_before(void *fixture) {
+    ARG_UNUSED(fixture);
+    // ztest threads are cooperative: make this one preemptible so the writer can interrupt a copy
+    k_thread_priority_set(k_current_get(), READER_PRIORITY);
+    memset(&rtdb, 0, sizeof(rtdb));
+    atomic_clear(&writer_stop);
+    atomic_clear(&writer_updates);
+}
+
+ZTEST_SUITE(rtdb_seqlock, NULL, NULL, rtdb_before, NULL, NULL);
+
+/**
+ * @brief Without the sequence lock the same reader does see torn records, so the test can
+ *        tell a broken read path from a working one.
+ */
+ZTEST(rtdb_seqlock, test_unguarded_read_tears) {
+    uint32_t torn;
+    uint32_t retries;
+    uint32_t reads = read_loop(READ_UNGUARDED, &torn, &retries);
+
+    zassert_true(atomic_get(&writer_updates) > 0, "Writer never ran");
+    zassert_true(torn > 0, "No torn read in %u unguarded reads, the race was not exercised", reads);
+}
+
+/**
+ * @brief Through the sequence lock every copy is a single generation, and some reads had to
+ *        be repeated because the writer got in.
+ */
+ZTEST(rtdb_seqlock, test_guarded_read_consistent) {
+    uint32_t torn;
+    uint32_t retries;
+    uint32_t reads = read_loop(READ_GUARDED, &torn, &retries);
+
+    zassert_true(atomic_get(&writer_updates) > 0, "Writer never ran");
+    zassert_true(retries > 0, "No read raced with the writer in %u reads", reads);
+    zassert_equal(torn, 0, "%u of %u reads were torn", torn, reads);
+}
+
+/**
+ * @brief rtdb_snapshot() never returns a torn record either.
+ */
+ZTEST(rtdb_seqlock, test_snapshot_consistent) {
+    uint32_t torn;
+    uint32_t retries;
+    uint32_t reads = read_loop(READ_SNAPSHOT, &torn, &retries);
+
+    zassert_true(atomic_get(&writer_updates) > 0, "Writer never ran");
+    zassert_equal(torn, 0, "%u of %u snapshots were torn", torn, reads);
+}
+
+static RtdbSubscription led_sub;
+static volatile uint32_t toggle_cycles;  // Cycle counter at the last toggle
+static volatile uint32_t seen_latency_us;  // Toggle-to-consumer time of the last toggle
+static atomic_t consumer_stop;
+K_SEM_DEFINE(toggle_seen, 0, 1);
+
+/**
+ * @brief Consumer: waits for LED1 to change, polling or on the subscription, and times the change.
+ *
+ * @param p1 Non-zero to wait on led_sub, otherwise poll every POLL_PERIOD_MS.
+ */
+static void consumer(void *p1, void *p2, void *p3) {
+    bool subscribed = (uintptr_t)p1 != 0;
+    int32_t last = rtdb_get(RTDB_POINT_LED1);
+
+    while (!atomic_get(&consumer_stop)) {
+        int32_t state = rtdb_get(RTDB_POINT_LED1);
+        if (state != last) {
+            last = state;
+            seen_latency_us = k_cyc_to_us_floor32(k_cycle_get_32() - toggle_cycles);
+            k_sem_give(&toggle_seen);
+        }
+        if (subscribed) {
+            rtdb_wait_changes(&led_sub, K_MSEC(POLL_PERIOD_MS));
+        } else {
+            k_msleep(POLL_PERIOD_MS);
+        }
+    }
+}
+
+/**
+ * @brief Toggles LED1 TOGGLE_COUNT times at irregular intervals and collects the consumer latency.
+ *
+ * @param subscribed Run the consumer on the subscription instead of polling.
+ * @param avg_us Receives the average latency.
+ * @param max_us Receives the worst latency.
+ */
+static void notify_run(bool subscribed, uint32_t *avg_us, uint32_t *max_us) {
+    uint64_t sum = 0;
+
+    *max_us = 0;
+    atomic_clear(&consumer_stop);
+    k_thread_create(&consumer_thread, consumer_stack, K_THREAD_STACK_SIZEOF(consumer_stack), consumer,
+                    (void *)(uintptr_t)subscribed, NULL, NULL, CONSUMER_PRIORITY, 0, K_NO_WAIT);
+    k_msleep(1);  // Let the consumer take its first reading
+
+    for (int i = 0; i < TOGGLE_COUNT; i++) {
+        // Spread the toggles over the polling period, so the polling consumer sees every phase
+        k_msleep(POLL_PERIOD_MS + (i * 37) % POLL_PERIOD_MS);
+        toggle_cycles = k_cycle_get_32();
+        k_spinlock_key_t key = rtdb_write_begin(RTDB_SITE_LED_TOGGLE);
+        uint32_t changed = rtdb_store(RTDB_POINT_LED1, !rtdb.data.points[RTDB_POINT_LED1], rtdb_now_us());
+        rtdb_write_end(key, changed);
+        zassert_ok(k_sem_take(&toggle_seen, K_MSEC(2 * POLL_PERIOD_MS)), "Toggle %d never seen", i);
+        sum += seen_latency_us;
+        *max_us = MAX(*max_us, seen_latency_us);
+    }
+    *avg_us = sum / TOGGLE_COUNT;
+
+    atomic_set(&consumer_stop, 1);
+    k_thread_join(&consumer_thread, K_FOREVER);
+}
+
+static void *notify_setup(void) {
+    rtdb_subscribe(&led_sub, RTDB_FIELD_LED(0));
+    return NULL;
+}
+
+static void notify_before(void *fixture) {
+    ARG_UNUSED(fixture);
+    k_thread_priority_set(k_current_get(), TOGGLER_PRIORITY);
+    k_sem_reset(&toggle_seen);
+}
+
+ZTEST_SUITE(rtdb_notify, NULL, notify_setup, notify_before, NULL, NULL);
+
+/**
+ * @brief A subscriber sees a toggle as soon as it is written, a poller up to a period later.
+ */
+ZTEST(rtdb_notify, test_subscriber_latency) {
+    uint32_t poll_avg, poll_max;
+    uint32_t sub_avg, sub_max;
+
+    notify_run(false, &poll_avg, &poll_max);
+    notify_run(true, &sub_avg, &sub_max);
+    TC_PRINT("toggle to consumer, %d toggles: polling %u ms avg %u us max %u us, subscribed avg %u us max %u us\n",
+             TOGGLE_COUNT, POLL_PERIOD_MS, poll_avg, poll_max, sub_avg, sub_max);
+    zassert_true(sub_max < poll_avg, "Subscriber not faster than polling");
+    zassert_true(sub_max < POLL_PERIOD_MS * USEC_PER_MSEC / 10, "Subscriber woke %u us late", sub_max);
+}